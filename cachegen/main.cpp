@@ -0,0 +1,166 @@
+// Populates a shader cache ahead of time, for baking into device images.
+//
+//   cachegen [--pack] [--compress] [--gles] [--version 3.0] [--rcc file.rcc] -o <dir> manifest.json
+//
+// The manifest lists the programs, each with one source per stage. Relative
+// paths are resolved against the manifest, ":/" paths come from the compiled
+// in or --rcc registered resources:
+//
+//   { "programs": [ { "vertex": "a.vert", "fragment": ":/shaders/a.frag" } ] }
+//
+// The entries are only usable on devices with the same GL_VENDOR, GL_RENDERER
+// and GL_VERSION strings as the driver this runs on. Run it headless with
+// QT_QPA_PLATFORM=offscreen, or with eglfs on top of Mesa's surfaceless EGL
+// platform (EGL_PLATFORM=surfaceless).
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QSurfaceFormat>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QResource>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <cstdio>
+#include "qopenglcacheableshaderprogram.h"
+
+static const struct {
+    const char *name;
+    QOpenGLShader::ShaderType type;
+} stages[] = {
+    { "vertex", QOpenGLShader::Vertex },
+    { "tessellationControl", QOpenGLShader::TessellationControl },
+    { "tessellationEvaluation", QOpenGLShader::TessellationEvaluation },
+    { "geometry", QOpenGLShader::Geometry },
+    { "fragment", QOpenGLShader::Fragment },
+    { "compute", QOpenGLShader::Compute }
+};
+
+int main(int argc, char **argv)
+{
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("manifest"), QStringLiteral("JSON list of programs"));
+    QCommandLineOption outputOption(QStringList() << QStringLiteral("o") << QStringLiteral("output"),
+                                    QStringLiteral("Cache directory to populate"), QStringLiteral("dir"));
+    QCommandLineOption packOption(QStringLiteral("pack"), QStringLiteral("Write a pack instead of one file per program"));
+    QCommandLineOption compressOption(QStringLiteral("compress"), QStringLiteral("Compress binaries where that saves space"));
+    QCommandLineOption glesOption(QStringLiteral("gles"), QStringLiteral("Use an OpenGL ES context"));
+    QCommandLineOption versionOption(QStringLiteral("version"), QStringLiteral("Context version"), QStringLiteral("major.minor"));
+    QCommandLineOption rccOption(QStringLiteral("rcc"), QStringLiteral("Register a binary resource file"), QStringLiteral("file"));
+    parser.addOption(outputOption);
+    parser.addOption(packOption);
+    parser.addOption(compressOption);
+    parser.addOption(glesOption);
+    parser.addOption(versionOption);
+    parser.addOption(rccOption);
+
+    // The cache reads its configuration on first use, which is after this.
+    QStringList args;
+    for (int i = 0; i < argc; ++i)
+        args.append(QString::fromLocal8Bit(argv[i]));
+    parser.parse(args);
+    if (parser.isSet(outputOption))
+        qputenv("QT_SHADER_CACHE_DIR", QFile::encodeName(parser.value(outputOption)));
+    if (parser.isSet(packOption))
+        qputenv("QT_SHADER_CACHE_PACK", "1");
+    if (parser.isSet(compressOption))
+        qputenv("QT_SHADER_CACHE_COMPRESS", "1");
+    qunsetenv("QT_DISABLE_SHADER_CACHE");
+    qunsetenv("QT_SHADER_CACHE_MAX_SIZE");
+    // Build times of this machine say nothing about loads on the devices, and
+    // every program is to end up in the cache.
+    qputenv("QT_SHADER_CACHE_BUILD_TIMES", "0");
+    qputenv("QT_SHADER_CACHE_ADAPTIVE", "0");
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication app(argc, argv);
+    parser.process(app);
+    if (parser.positionalArguments().count() != 1 || !parser.isSet(outputOption))
+        parser.showHelp(1);
+
+    for (const QString &rcc : parser.values(rccOption)) {
+        if (!QResource::registerResource(rcc))
+            qFatal("Failed to register %s", qPrintable(rcc));
+    }
+
+    const QString manifestName = parser.positionalArguments().first();
+    QFile manifest(manifestName);
+    if (!manifest.open(QIODevice::ReadOnly))
+        qFatal("Failed to open %s", qPrintable(manifestName));
+    QJsonParseError error;
+    const QJsonDocument doc = QJsonDocument::fromJson(manifest.readAll(), &error);
+    if (doc.isNull())
+        qFatal("%s: %s", qPrintable(manifestName), qPrintable(error.errorString()));
+    const QDir baseDir = QFileInfo(manifestName).absoluteDir();
+
+    QSurfaceFormat fmt = QSurfaceFormat::defaultFormat();
+    if (parser.isSet(glesOption))
+        fmt.setRenderableType(QSurfaceFormat::OpenGLES);
+    if (parser.isSet(versionOption)) {
+        const QStringList v = parser.value(versionOption).split(QLatin1Char('.'));
+        fmt.setVersion(v.value(0).toInt(), v.value(1).toInt());
+    }
+    QOpenGLContext context;
+    context.setFormat(fmt);
+    if (!context.create())
+        qFatal("Failed to create context");
+    QOffscreenSurface surface;
+    surface.setFormat(context.format());
+    surface.create();
+    if (!context.makeCurrent(&surface))
+        qFatal("Failed to make context current");
+
+    // The target devices must report the very same strings.
+    QOpenGLFunctions *f = context.functions();
+    printf("GL_VENDOR: %s\nGL_RENDERER: %s\nGL_VERSION: %s\n",
+           reinterpret_cast<const char *>(f->glGetString(GL_VENDOR)),
+           reinterpret_cast<const char *>(f->glGetString(GL_RENDERER)),
+           reinterpret_cast<const char *>(f->glGetString(GL_VERSION)));
+    if (context.isOpenGLES() ? context.format().majorVersion() < 3 && !context.hasExtension("GL_OES_get_program_binary")
+                             : !context.hasExtension("GL_ARB_get_program_binary"))
+        qWarning("Program binaries are not supported by this driver, nothing will be cached");
+
+    QVector<QOpenGLCacheableShaderProgram *> programs;
+    const QJsonArray list = doc.object().value(QStringLiteral("programs")).toArray();
+    for (const QJsonValue &v : list) {
+        const QJsonObject desc = v.toObject();
+        QOpenGLCacheableShaderProgram *prog = new QOpenGLCacheableShaderProgram;
+        for (const auto &stage : stages) {
+            const QString source = desc.value(QLatin1String(stage.name)).toString();
+            if (source.isEmpty())
+                continue;
+            const QString fileName = source.startsWith(QLatin1String(":/")) ? source : baseDir.absoluteFilePath(source);
+            if (!prog->addCacheableShaderFromSourceFile(stage.type, fileName))
+                qFatal("Failed to add %s", qPrintable(fileName));
+        }
+        programs.append(prog);
+    }
+
+    const bool ok = QOpenGLCacheableShaderProgram::linkAll(programs);
+    for (QOpenGLCacheableShaderProgram *prog : qAsConst(programs)) {
+        if (!prog->isLinked())
+            qWarning("Link failed: %s", qPrintable(prog->log()));
+    }
+    qDeleteAll(programs);
+    QOpenGLCacheableShaderProgram::flushCache();
+    context.doneCurrent();
+
+    // The namespace just written is the one used last.
+    const QFileInfoList namespaces = QDir(parser.value(outputOption)).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
+    QFileInfo newest;
+    for (const QFileInfo &fi : namespaces) {
+        const QFileInfo stamp(fi.filePath() + QStringLiteral("/last.used"));
+        if (stamp.exists() && (!newest.exists() || stamp.lastModified() > newest.lastModified()))
+            newest = stamp;
+    }
+    if (newest.exists())
+        printf("%d programs cached for driver %s\n", programs.count(), qPrintable(newest.dir().dirName()));
+    return ok ? 0 : 2;
+}
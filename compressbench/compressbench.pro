@@ -0,0 +1,8 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+INCLUDEPATH += ..
+
+SOURCES = main.cpp ../qopengllz4.cpp
+HEADERS = ../qopengllz4_p.h
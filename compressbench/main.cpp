@@ -0,0 +1,128 @@
+// Compares on-disk size and load time of program binaries stored plain and
+// LZ4 compressed. Takes a shader cache directory (every file in it and its
+// subdirectories is used as a binary) and writes both variants of each to a
+// scratch directory. Loads are timed with the files dropped from the page
+// cache first (on Linux), so the numbers include the storage read.
+//
+//   compressbench <cachedir> [scratchdir] [rounds]
+
+#include <QCoreApplication>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QFile>
+#include <QDir>
+#include <QVector>
+#include <algorithm>
+#include <cstdio>
+#include "qopengllz4_p.h"
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static void dropFromPageCache(const QString &fn)
+{
+#ifdef Q_OS_LINUX
+    const int fd = ::open(QFile::encodeName(fn).constData(), O_RDONLY);
+    if (fd >= 0) {
+        ::fdatasync(fd);
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+#else
+    Q_UNUSED(fn);
+#endif
+}
+
+static QByteArray readFile(const QString &fn)
+{
+    QFile f(fn);
+    return f.open(QIODevice::ReadOnly) ? f.readAll() : QByteArray();
+}
+
+static double median(QVector<qint64> v)
+{
+    std::sort(v.begin(), v.end());
+    return v.isEmpty() ? 0 : v[v.count() / 2] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = app.arguments();
+    if (args.count() < 2) {
+        fprintf(stderr, "usage: compressbench <cachedir> [scratchdir] [rounds]\n");
+        return 1;
+    }
+    QTemporaryDir tmp(args.count() > 2 ? args[2] + QLatin1String("/compressbench-XXXXXX") : QString());
+    const int rounds = args.count() > 3 ? args[3].toInt() : 5;
+
+    QStringList plain, compressed;
+    QVector<int> rawSizes;
+    qint64 plainTotal = 0, compressedTotal = 0, compressTime = 0;
+    QDirIterator it(args[1], QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        const QString fn = it.next();
+        if (it.fileName().contains(QLatin1Char('.')))
+            continue;
+        const QByteArray raw = readFile(fn);
+        if (raw.isEmpty())
+            continue;
+        QByteArray lz4(QOpenGLLz4::compressBound(raw.size()), Qt::Uninitialized);
+        QElapsedTimer t;
+        t.start();
+        const int size = QOpenGLLz4::compress(reinterpret_cast<const uchar *>(raw.constData()), raw.size(),
+                                              reinterpret_cast<uchar *>(lz4.data()), lz4.size());
+        compressTime += t.nsecsElapsed();
+        lz4.resize(size);
+
+        const QString name = tmp.path() + QLatin1Char('/') + QString::number(plain.count());
+        QFile p(name + QLatin1String(".raw")), c(name + QLatin1String(".lz4"));
+        if (!p.open(QIODevice::WriteOnly) || !c.open(QIODevice::WriteOnly))
+            qFatal("Cannot write to %s", qPrintable(tmp.path()));
+        p.write(raw);
+        c.write(lz4);
+        plain.append(p.fileName());
+        compressed.append(c.fileName());
+        rawSizes.append(raw.size());
+        plainTotal += raw.size();
+        compressedTotal += size;
+    }
+    if (plain.isEmpty()) {
+        fprintf(stderr, "No binaries found in %s\n", qPrintable(args[1]));
+        return 1;
+    }
+
+    QVector<qint64> plainLoads, compressedLoads;
+    for (int r = 0; r < rounds; ++r) {
+        for (const QString &fn : qAsConst(plain))
+            dropFromPageCache(fn);
+        for (const QString &fn : qAsConst(compressed))
+            dropFromPageCache(fn);
+
+        QElapsedTimer t;
+        t.start();
+        for (const QString &fn : qAsConst(plain))
+            readFile(fn);
+        plainLoads.append(t.nsecsElapsed());
+
+        t.restart();
+        QByteArray out;
+        for (int i = 0; i < compressed.count(); ++i) {
+            const QByteArray lz4 = readFile(compressed[i]);
+            out.resize(rawSizes[i]);
+            if (!QOpenGLLz4::decompress(reinterpret_cast<const uchar *>(lz4.constData()), lz4.size(),
+                                        reinterpret_cast<uchar *>(out.data()), out.size()))
+                qFatal("Decompression failed");
+        }
+        compressedLoads.append(t.nsecsElapsed());
+    }
+
+    printf("%d binaries\n", plain.count());
+    printf("plain:      %10lld bytes, load %10.1f us\n", plainTotal, median(plainLoads));
+    printf("compressed: %10lld bytes, load %10.1f us (ratio %.3f, compress %.1f us)\n",
+           compressedTotal, median(compressedLoads), double(compressedTotal) / plainTotal, compressTime / 1000.0);
+    return 0;
+}
@@ -0,0 +1,10 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+INCLUDEPATH += ..
+
+SOURCES = main.cpp ../qopenglcacheableshaderprogram.cpp ../qopenglprogrambinarycache.cpp ../qopenglprogrambinarypack.cpp ../qopenglshaderhash.cpp ../qopengllz4.cpp
+HEADERS = ../qopenglcacheableshaderprogram.h ../qopenglprogrambinarycache_p.h ../qopenglprogrambinarypack_p.h ../qopenglshaderhash_p.h ../qopengllz4_p.h
+
+QT += core-private gui-private
@@ -0,0 +1,191 @@
+// Throughput of the cache's load and save paths, without a GL implementation.
+// A fake driver hands out synthetic binaries of --size bytes, optionally taking
+// --latency microseconds per glProgramBinary/glGetProgramBinary, so that the
+// entry format, the files or pack, compression and the memory cache can be
+// profiled and stressed with many entries and threads on any machine.
+//
+//   iobench [--entries 20000] [--size 32768] [--threads 4] [--latency 0]
+//           [--pack] [--compress] [--dir cachedir]
+//
+// Reports saves (including the background writes), loads from disk with the
+// memory cache off, and loads from the memory cache.
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QThread>
+#include <QAtomicInt>
+#include <QFile>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include "qopenglprogrambinarycache_p.h"
+#include "qopenglshaderhash_p.h"
+
+class FakeBackend : public QOpenGLProgramBinaryBackend
+{
+public:
+    enum { Format = 0xFA4E };
+
+    FakeBackend(int size, int latencyUs)
+        : m_latencyUs(latencyUs)
+    {
+        // Compresses somewhat like real binaries: instruction words from a small
+        // set with varying operands.
+        m_blob.resize(size & ~3);
+        quint32 *p = reinterpret_cast<quint32 *>(m_blob.data());
+        quint32 seed = 1;
+        for (int i = 0; i < m_blob.size() / 4; ++i) {
+            seed = seed * 1103515245 + 12345;
+            p[i] = ((seed >> 16) & 0x3F) << 24 | (seed >> 8 & 0xFF);
+        }
+        m_fingerprint = "fake" + QByteArray::number(size);
+    }
+
+    QByteArray fingerprint() const override { return m_fingerprint; }
+
+    bool programBinary(uint, uint binaryFormat, const void *binary, uint length) const override
+    {
+        simulateLatency();
+        return binaryFormat == Format && length == uint(m_blob.size())
+                && !memcmp(binary, m_blob.constData(), length);
+    }
+
+    uint programBinaryLength(uint) const override { return m_blob.size(); }
+
+    uint getProgramBinary(uint, uint bufSize, uint *binaryFormat, void *binary) const override
+    {
+        simulateLatency();
+        const uint length = qMin(bufSize, uint(m_blob.size()));
+        memcpy(binary, m_blob.constData(), length);
+        *binaryFormat = Format;
+        return length;
+    }
+
+private:
+    void simulateLatency() const
+    {
+        if (m_latencyUs)
+            QThread::usleep(m_latencyUs);
+    }
+
+    QByteArray m_blob;
+    QByteArray m_fingerprint;
+    int m_latencyUs;
+};
+
+class Task : public QRunnable
+{
+public:
+    Task(const std::function<void()> &f) : m_f(f) { }
+    void run() override { m_f(); }
+
+private:
+    std::function<void()> m_f;
+};
+
+// Runs f(first, last) for equal slices of [0, count) on the given number of
+// threads and returns the time in seconds.
+static double runParallel(QThreadPool *pool, int threads, int count, const std::function<void(int, int)> &f)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int t = 0; t < threads; ++t) {
+        const int first = count * t / threads;
+        const int last = count * (t + 1) / threads;
+        pool->start(new Task([=] { f(first, last); }));
+    }
+    pool->waitForDone();
+    return timer.nsecsElapsed() / 1e9;
+}
+
+static void report(const char *name, int entries, int size, double secs, int failures)
+{
+    printf("%-7s %8d entries %9.3f s %10.0f entries/s %9.1f MB/s", name, entries, secs,
+           entries / secs, double(entries) * size / secs / (1024 * 1024));
+    if (failures)
+        printf("  %d failed", failures);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption entriesOption(QStringLiteral("entries"), QStringLiteral("Number of programs"), QStringLiteral("count"), QStringLiteral("20000"));
+    QCommandLineOption sizeOption(QStringLiteral("size"), QStringLiteral("Binary size"), QStringLiteral("bytes"), QStringLiteral("32768"));
+    QCommandLineOption threadsOption(QStringLiteral("threads"), QStringLiteral("Loading and saving threads"), QStringLiteral("count"), QStringLiteral("4"));
+    QCommandLineOption latencyOption(QStringLiteral("latency"), QStringLiteral("Driver time per binary call"), QStringLiteral("us"), QStringLiteral("0"));
+    QCommandLineOption packOption(QStringLiteral("pack"), QStringLiteral("Use a pack instead of one file per program"));
+    QCommandLineOption compressOption(QStringLiteral("compress"), QStringLiteral("Compress binaries"));
+    QCommandLineOption dirOption(QStringLiteral("dir"), QStringLiteral("Cache directory instead of a temporary one"), QStringLiteral("dir"));
+    parser.addOption(entriesOption);
+    parser.addOption(sizeOption);
+    parser.addOption(threadsOption);
+    parser.addOption(latencyOption);
+    parser.addOption(packOption);
+    parser.addOption(compressOption);
+    parser.addOption(dirOption);
+    parser.process(app);
+
+    const int entries = qMax(1, parser.value(entriesOption).toInt());
+    const int size = qMax(4, parser.value(sizeOption).toInt());
+    const int threads = qMax(1, parser.value(threadsOption).toInt());
+
+    // The cache reads its configuration on construction.
+    QTemporaryDir tempDir;
+    qputenv("QT_SHADER_CACHE_DIR", QFile::encodeName(parser.isSet(dirOption) ? parser.value(dirOption) : tempDir.path()));
+    qputenv("QT_SHADER_CACHE_PACK", parser.isSet(packOption) ? "1" : "0");
+    qputenv("QT_SHADER_CACHE_COMPRESS", parser.isSet(compressOption) ? "1" : "0");
+    qunsetenv("QT_SHADER_CACHE_MAX_SIZE");
+    qunsetenv("QT_DISABLE_SHADER_CACHE");
+
+    FakeBackend backend(size, parser.value(latencyOption).toInt());
+    QVector<QByteArray> keys;
+    keys.reserve(entries);
+    for (int i = 0; i < entries; ++i)
+        keys.append(QOpenGLShaderHash::hash(QByteArray::number(i)));
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    QAtomicInt failures;
+
+    {
+        QOpenGLProgramBinaryCache cache;
+        const double secs = runParallel(&pool, threads, entries, [&](int first, int last) {
+            for (int i = first; i < last; ++i)
+                cache.save(&backend, keys.at(i), uint(i + 1));
+        });
+        QElapsedTimer flushTimer;
+        flushTimer.start();
+        cache.flush();
+        report("save", entries, size, secs + flushTimer.nsecsElapsed() / 1e9, 0);
+    }
+
+    // A new instance, so that a pack is mapped with everything in it.
+    QOpenGLProgramBinaryCache cache;
+    cache.setMaxMemorySize(0);
+    double secs = runParallel(&pool, threads, entries, [&](int first, int last) {
+        for (int i = first; i < last; ++i) {
+            if (!cache.load(&backend, keys.at(i), uint(i + 1)))
+                failures.ref();
+        }
+    });
+    report("disk", entries, size, secs, failures.fetchAndStoreRelaxed(0));
+
+    cache.setMaxMemorySize(qint64(entries) * size * 2);
+    for (int i = 0; i < entries; ++i)
+        cache.load(&backend, keys.at(i), uint(i + 1));
+    secs = runParallel(&pool, threads, entries, [&](int first, int last) {
+        for (int i = first; i < last; ++i) {
+            if (!cache.load(&backend, keys.at(i), uint(i + 1)))
+                failures.ref();
+        }
+    });
+    report("memory", entries, size, secs, failures.fetchAndStoreRelaxed(0));
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Measures the per-link cost of building a cache key, for a small and a
+// 50 KB source: SHA-1 + toHex as used before, hashing the sources with
+// MurmurHash3, and the actual key function, which memoizes source digests
+// and so only pays for sources it has not seen.
+//
+//   keybench [iterations]
+
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <cstdio>
+#include "qopenglprogrambinarycache_p.h"
+#include "qopenglshaderhash_p.h"
+
+static QByteArray sha1Key(const QOpenGLProgramBinaryCache::ProgramDesc &program)
+{
+    QCryptographicHash keyBuilder(QCryptographicHash::Sha1);
+    for (const QOpenGLProgramBinaryCache::ShaderDesc &shader : program.shaders)
+        keyBuilder.addData(shader.source);
+    return keyBuilder.result().toHex();
+}
+
+static QByteArray murmurKey(const QOpenGLProgramBinaryCache::ProgramDesc &program)
+{
+    uchar digests[8][QOpenGLShaderHash::Size];
+    int i = 0;
+    for (const QOpenGLProgramBinaryCache::ShaderDesc &shader : program.shaders)
+        QOpenGLShaderHash::hash(shader.source.constData(), shader.source.size(), 0, digests[i++]);
+    QByteArray key(QOpenGLShaderHash::Size, Qt::Uninitialized);
+    QOpenGLShaderHash::hash(digests, i * QOpenGLShaderHash::Size, 0, reinterpret_cast<uchar *>(key.data()));
+    return key;
+}
+
+static QByteArray makeSource(int size)
+{
+    QByteArray src("uniform highp mat4 matrix;\nattribute highp vec4 posAttr;\nvoid main() {\n");
+    for (int i = 0; src.size() < size - 32; ++i)
+        src += "    gl_Position = matrix * posAttr; // " + QByteArray::number(i) + '\n';
+    src += "}\n";
+    return src;
+}
+
+template <typename F>
+static void run(const char *name, const QOpenGLProgramBinaryCache::ProgramDesc &program, int iterations, F keyFunc)
+{
+    QByteArray sink;
+    QElapsedTimer t;
+    t.start();
+    for (int i = 0; i < iterations; ++i)
+        sink = keyFunc(program);
+    const double ns = double(t.nsecsElapsed()) / iterations;
+    printf("%-9s %8d bytes %10.1f ns/link %8.1f MB/s\n", name,
+           program.shaders[0].source.size() + program.shaders[1].source.size(),
+           ns, (program.shaders[0].source.size() + program.shaders[1].source.size()) * 1000.0 / ns);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    const int iterations = app.arguments().count() > 1 ? app.arguments().at(1).toInt() : 10000;
+
+    for (int size : { 256, 50 * 1024 }) {
+        QOpenGLProgramBinaryCache::ProgramDesc program;
+        program.shaders.append({ QOpenGLShader::Vertex, makeSource(size), QByteArrayList() });
+        program.shaders.append({ QOpenGLShader::Fragment, makeSource(size / 2), QByteArrayList() });
+        run("sha1", program, iterations, sha1Key);
+        run("murmur3", program, iterations, murmurKey);
+        run("memoized", program, iterations, QOpenGLProgramBinaryCache::cacheKey);
+    }
+    return 0;
+}
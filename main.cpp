@@ -9,6 +9,7 @@
 
 static const int COUNT = 100;
 bool DIFF = false;
+bool BATCH = false;
 
 static const char *vsrc =
     "attribute highp vec4 posAttr;\n"
@@ -71,10 +72,12 @@ public:
             vs.replace("//$$", s.toLatin1());
             prog->addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vs);
             prog->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fsrc);
-            if (!prog->link())
+            if (!BATCH && !prog->link())
                 qFatal("link failed");
             m_programs.append(prog);
         }
+        if (BATCH && !QOpenGLCacheableShaderProgram::linkAll(m_programs))
+            qFatal("link failed");
 
         QOpenGLCacheableShaderProgram *prog = m_programs[0];
         m_posAttr = prog->attributeLocation("posAttr");
@@ -134,6 +137,8 @@ int main(int argc, char **argv)
     for (int i = 0; i < args.count(); ++i)
         if (args[i] == QStringLiteral("--recompile"))
             DIFF = true;
+        else if (args[i] == QStringLiteral("--batch"))
+            BATCH = true;
 
     Window w;
     w.resize(1024, 768);
@@ -40,99 +40,282 @@
 #include "qopenglcacheableshaderprogram.h"
 #include "qopenglprogrambinarycache_p.h"
 #include <QFile>
+#include <QResource>
 #include <QLoggingCategory>
-#include <QCryptographicHash>
 #include <QCoreApplication>
 #include <QOpenGLExtraFunctions>
+#include <QOffscreenSurface>
+#include <QFutureInterface>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
 #include <QtGui/private/qopenglcontext_p.h>
 
 QT_BEGIN_NAMESPACE
 
-#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
-#define GL_NUM_PROGRAM_BINARY_FORMATS     0x87FE
+#ifndef GL_GEOMETRY_SHADER
+#define GL_GEOMETRY_SHADER                0x8DD9
+#endif
+#ifndef GL_TESS_EVALUATION_SHADER
+#define GL_TESS_EVALUATION_SHADER         0x8E87
+#endif
+#ifndef GL_TESS_CONTROL_SHADER
+#define GL_TESS_CONTROL_SHADER            0x8E88
+#endif
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER                 0x91B9
+#endif
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR          0x91B1
 #endif
 
 Q_LOGGING_CATEGORY(DBG_SHADER_CACHE, "qt.opengl.diskcache")
 
-// While unlikely, one application can in theory use contexts with different versions
-// or profiles. Therefore any version- or extension-specific checks must be done on a
-// per-context basis, not just once per process. QOpenGLSharedResource enables this,
-// although it's once-per-sharing-context-group, not per-context. Still, this should
-// be good enough in practice.
-class QOpenGLProgramBinarySupportCheck : public QOpenGLSharedResource
+Q_GLOBAL_STATIC(QOpenGLProgramBinarySupportCheckWrapper, qt_gl_program_binary_support_check)
+
+Q_GLOBAL_STATIC(QOpenGLProgramBinaryCache, qt_gl_program_binary_cache)
+
+static void qt_gl_program_binary_cache_warm_up()
+{
+    if (qEnvironmentVariableIntValue("QT_SHADER_CACHE_WARMUP")
+            && !qEnvironmentVariableIntValue("QT_DISABLE_SHADER_CACHE"))
+        QOpenGLCacheableShaderProgram::warmUpCache();
+}
+
+Q_COREAPP_STARTUP_FUNCTION(qt_gl_program_binary_cache_warm_up)
+
+class QOpenGLCacheableShaderProgramPrivate
 {
 public:
-    QOpenGLProgramBinarySupportCheck(QOpenGLContext *context);
-    void invalidateResource() override { }
-    void freeResource(QOpenGLContext *) override { }
+    QOpenGLCacheableShaderProgramPrivate(QOpenGLCacheableShaderProgram *q) : q(q) { }
 
-    bool isSupported() const { return m_supported; }
+    QOpenGLCacheableShaderProgram *q;
+    QOpenGLProgramBinaryCache::ProgramDesc program;
 
-private:
-    bool m_supported;
-};
+    QOpenGLProgramBinarySupportCheck *supportCheck()
+    {
+        return qt_gl_program_binary_support_check()->get(QOpenGLContext::currentContext());
+    }
 
-QOpenGLProgramBinarySupportCheck::QOpenGLProgramBinarySupportCheck(QOpenGLContext *context)
-    : QOpenGLSharedResource(context->shareGroup()),
-      m_supported(false)
-{
-    if (qEnvironmentVariableIntValue("QT_DISABLE_SHADER_CACHE") == 0) {
-        QOpenGLContext *ctx = QOpenGLContext::currentContext();
-        if (ctx) {
-            if (ctx->isOpenGLES()) {
-                qCDebug(DBG_SHADER_CACHE, "OpenGL ES v%d context", ctx->format().majorVersion());
-                if (ctx->format().majorVersion() >= 3)
-                    m_supported = true;
-            } else {
-                const bool hasExt = ctx->hasExtension("GL_ARB_get_program_binary");
-                qCDebug(DBG_SHADER_CACHE, "GL_ARB_get_program_binary support = %d", hasExt);
-                if (hasExt)
-                    m_supported = true;
-            }
-            if (m_supported) {
-                GLint fmtCount = 0;
-                ctx->functions()->glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &fmtCount);
-                qCDebug(DBG_SHADER_CACHE, "Supported binary format count = %d", fmtCount);
-                m_supported = fmtCount > 0;
-            }
-        }
-        qCDebug(DBG_SHADER_CACHE, "Shader cache supported = %d", m_supported);
-    } else {
-        qCDebug(DBG_SHADER_CACHE, "Shader cache disabled via env var");
+    bool isCacheDisabled()
+    {
+        return !supportCheck()->isSupported();
     }
-}
 
-class QOpenGLProgramBinarySupportCheckWrapper
+    // Sources are kept and compiled at link time when the result can either be
+    // cached or compiled in parallel with other programs in linkAll().
+    bool defersCompile()
+    {
+        QOpenGLProgramBinarySupportCheck *support = supportCheck();
+        return support->isSupported() || support->hasParallelShaderCompile();
+    }
+
+    bool buildCacheKey();
+    bool loadFromCache();
+    bool saveToCache();
+    bool compileCacheable();
+    void setRetrievableHint();
+    bool linkCompiled();
+    bool compileLinkAndSave();
+    void releaseSources();
+    void releaseSourcesIfCached();
+    bool hasReleasedSources();
+    bool relinkFromCache();
+
+    bool dispatchCompileAndLink();
+    bool isDispatchedLinkComplete();
+    bool finishDispatchedLink();
+
+    QByteArray cacheKey;
+    QVector<GLuint> dispatchedShaders;
+    // Started before compiling, stored with the binary for the adaptive policy.
+    QElapsedTimer buildTimer;
+};
+
+// Links programs for linkAsync() on a context sharing with the one they are
+// used on. The programs live in this thread while they are linked.
+class QOpenGLAsyncLinker : public QThread
 {
 public:
-    QOpenGLProgramBinarySupportCheck *get(QOpenGLContext *context)
+    QOpenGLAsyncLinker(QOpenGLContext *context, QOffscreenSurface *surface)
+        : m_context(context),
+          m_surface(surface),
+          m_stop(false)
     {
-        return m_resource.value<QOpenGLProgramBinarySupportCheck>(context);
+        setObjectName(QStringLiteral("QOpenGLAsyncLinker"));
+        m_context->moveToThread(this);
     }
+    ~QOpenGLAsyncLinker();
+
+    void enqueue(const QVector<QOpenGLCacheableShaderProgram *> &programs, bool dispose,
+                 const QFutureInterface<bool> &result);
+
+protected:
+    void run() override;
 
 private:
-    QOpenGLMultiGroupSharedResource m_resource;
+    // Programs are either handed back to the origin thread or, when only
+    // linked to prime the cache, deleted.
+    struct Job {
+        QVector<QOpenGLCacheableShaderProgram *> programs;
+        QThread *origin;
+        QFutureInterface<bool> result;
+    };
+
+    QOpenGLContext *m_context;
+    QOffscreenSurface *m_surface;
+    QMutex m_lock;
+    QWaitCondition m_workAvailable;
+    QQueue<Job> m_queue;
+    bool m_stop;
 };
 
-Q_GLOBAL_STATIC(QOpenGLProgramBinarySupportCheckWrapper, qt_gl_program_binary_support_check)
+static QAtomicPointer<QOpenGLAsyncLinker> qt_gl_async_linker;
 
-Q_GLOBAL_STATIC(QOpenGLProgramBinaryCache, qt_gl_program_binary_cache)
+// Finishes what is queued. The surface belongs to the GUI thread, which is
+// where this runs, on aboutToQuit.
+QOpenGLAsyncLinker::~QOpenGLAsyncLinker()
+{
+    {
+        QMutexLocker locker(&m_lock);
+        m_stop = true;
+        m_workAvailable.wakeAll();
+    }
+    wait();
+    delete m_surface;
+}
 
-class QOpenGLCacheableShaderProgramPrivate
+void QOpenGLAsyncLinker::enqueue(const QVector<QOpenGLCacheableShaderProgram *> &programs, bool dispose,
+                                 const QFutureInterface<bool> &result)
 {
-public:
-    QOpenGLCacheableShaderProgramPrivate(QOpenGLCacheableShaderProgram *q) : q(q) { }
+    QMutexLocker locker(&m_lock);
+    QThread *origin = dispose ? nullptr : QThread::currentThread();
+    for (QOpenGLCacheableShaderProgram *program : programs)
+        program->moveToThread(this);
+    m_queue.enqueue({ programs, origin, result });
+    m_workAvailable.wakeOne();
+}
 
-    QOpenGLCacheableShaderProgram *q;
-    QOpenGLProgramBinaryCache::ProgramDesc program;
+void QOpenGLAsyncLinker::run()
+{
+    const bool current = m_context->makeCurrent(m_surface);
+    if (!current)
+        qWarning("QOpenGLCacheableShaderProgram: Failed to make the asynchronous linking context current");
 
-    bool isCacheDisabled()
-    {
-        return !qt_gl_program_binary_support_check()->get(QOpenGLContext::currentContext())->isSupported();
+    for (;;) {
+        Job job;
+        {
+            QMutexLocker locker(&m_lock);
+            while (m_queue.isEmpty() && !m_stop)
+                m_workAvailable.wait(&m_lock);
+            if (m_queue.isEmpty())
+                break;
+            job = m_queue.dequeue();
+        }
+
+        bool ok = false;
+        if (current) {
+            ok = QOpenGLCacheableShaderProgram::linkAll(job.programs);
+            // Makes the results visible to the other contexts of the share group.
+            m_context->functions()->glFinish();
+        }
+        if (job.origin) {
+            for (QOpenGLCacheableShaderProgram *program : qAsConst(job.programs))
+                program->moveToThread(job.origin);
+        } else {
+            qDeleteAll(job.programs);
+        }
+        job.result.reportResult(ok);
+        job.result.reportFinished();
     }
 
-    bool compileCacheable();
-};
+    m_context->doneCurrent();
+    delete m_context;
+}
+
+// Returns the offset just past the #version directive if that is the first
+// directive in the source, otherwise 0. versionLine is set to its line number,
+// or 0 when there is none.
+static int versionDirectiveEnd(const QByteArray &source, int *versionLine)
+{
+    // Skip whitespace and comments to see if the first directive is #version.
+    int pos = 0;
+    int line = 1;
+    const int len = source.size();
+    const char *s = source.constData();
+    while (pos < len) {
+        if (s[pos] == '\n') {
+            ++line;
+            ++pos;
+        } else if (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\r') {
+            ++pos;
+        } else if (pos + 1 < len && s[pos] == '/' && s[pos + 1] == '/') {
+            while (pos < len && s[pos] != '\n')
+                ++pos;
+        } else if (pos + 1 < len && s[pos] == '/' && s[pos + 1] == '*') {
+            pos += 2;
+            while (pos + 1 < len && !(s[pos] == '*' && s[pos + 1] == '/')) {
+                if (s[pos] == '\n')
+                    ++line;
+                ++pos;
+            }
+            pos += 2;
+        } else {
+            break;
+        }
+    }
+
+    int versionEnd = 0;
+    *versionLine = 0;
+    if (pos < len && s[pos] == '#') {
+        int p = pos + 1;
+        while (p < len && (s[p] == ' ' || s[p] == '\t'))
+            ++p;
+        if (source.mid(p, 7) == "version") {
+            versionEnd = source.indexOf('\n', p);
+            versionEnd = versionEnd < 0 ? len : versionEnd + 1;
+            *versionLine = line;
+        }
+    }
+    return versionEnd;
+}
+
+// The source a shader is compiled from: for a variant, its defines follow the
+// #version directive, and a #line keeps compiler messages in terms of the
+// original source.
+static QByteArray variantSource(const QOpenGLProgramBinaryCache::ShaderDesc &shader)
+{
+    if (shader.defines.isEmpty())
+        return shader.source;
+
+    int versionLine;
+    const int versionEnd = versionDirectiveEnd(shader.source, &versionLine);
+    const int len = shader.source.size();
+    const char *s = shader.source.constData();
+
+    QByteArray result;
+    result.reserve(len + 32 * (shader.defines.count() + 1));
+    result.append(s, versionEnd);
+    for (const QByteArray &define : shader.defines) {
+        // "NAME", "NAME VALUE" or "NAME=VALUE"
+        const int eq = define.indexOf('=');
+        result.append("#define ");
+        if (eq < 0) {
+            result.append(define);
+        } else {
+            result.append(define.constData(), eq);
+            result.append(' ');
+            result.append(define.constData() + eq + 1, define.size() - eq - 1);
+        }
+        result.append('\n');
+    }
+    result.append("#line ");
+    result.append(QByteArray::number(versionLine + 1));
+    result.append('\n');
+    result.append(s + versionEnd, len - versionEnd);
+    return result;
+}
 
 QOpenGLCacheableShaderProgram::QOpenGLCacheableShaderProgram(QObject *parent)
     : QOpenGLShaderProgram(parent),
@@ -147,16 +330,16 @@ QOpenGLCacheableShaderProgram::~QOpenGLCacheableShaderProgram()
 
 bool QOpenGLCacheableShaderProgram::addCacheableShaderFromSourceCode(QOpenGLShader::ShaderType type, const char *source)
 {
-    if (d->isCacheDisabled())
+    if (!d->defersCompile())
         return addShaderFromSourceCode(type, source);
 
-    addCacheableShaderFromSourceCode(type, QByteArray(source));
+    addCacheableShaderFromSourceCode(type, QOpenGLProgramBinaryCache::internSource(source));
     return true;
 }
 
 bool QOpenGLCacheableShaderProgram::addCacheableShaderFromSourceCode(QOpenGLShader::ShaderType type, const QByteArray &source)
 {
-    if (d->isCacheDisabled())
+    if (!d->defersCompile())
         return addShaderFromSourceCode(type, source);
 
     QOpenGLProgramBinaryCache::ShaderDesc shader;
@@ -168,20 +351,51 @@ bool QOpenGLCacheableShaderProgram::addCacheableShaderFromSourceCode(QOpenGLShad
 
 bool QOpenGLCacheableShaderProgram::addCacheableShaderFromSourceCode(QOpenGLShader::ShaderType type, const QString &source)
 {
-    if (d->isCacheDisabled())
+    if (!d->defersCompile())
         return addShaderFromSourceCode(type, source);
 
-    addCacheableShaderFromSourceCode(type, source.toUtf8().constData());
+    addCacheableShaderFromSourceCode(type, source.toUtf8());
+    return true;
+}
+
+// Adds a permutation of an uber-shader: source compiled with a #define for each
+// of defines ("NAME", "NAME VALUE" or "NAME=VALUE") inserted after its
+// #version directive. The cache key is derived from the digest of source,
+// which is computed once for all its variants, and a hash of the defines, so
+// the expanded source is only ever built when a variant needs compiling.
+bool QOpenGLCacheableShaderProgram::addCacheableShaderVariant(QOpenGLShader::ShaderType type, const QByteArray &source,
+                                                              const QByteArrayList &defines)
+{
+    QOpenGLProgramBinaryCache::ShaderDesc shader;
+    shader.type = type;
+    shader.source = source;
+    shader.defines = defines;
+    if (!d->defersCompile())
+        return addShaderFromSourceCode(type, variantSource(shader));
+
+    d->program.shaders.append(shader);
     return true;
 }
 
 bool QOpenGLCacheableShaderProgram::addCacheableShaderFromSourceFile(QOpenGLShader::ShaderType type, const QString &fileName)
 {
-    if (d->isCacheDisabled())
+    if (!d->defersCompile())
         return addShaderFromSourceFile(type, fileName);
 
     QOpenGLProgramBinaryCache::ShaderDesc shader;
     shader.type = type;
+
+    // Uncompressed resources are used in place.
+    if (fileName.startsWith(QLatin1Char(':'))) {
+        QResource resource(fileName);
+        if (resource.isValid() && !resource.isCompressed() && resource.data()) {
+            shader.source = QByteArray::fromRawData(reinterpret_cast<const char *>(resource.data()),
+                                                    int(resource.size()));
+            d->program.shaders.append(shader);
+            return true;
+        }
+    }
+
     QFile f(fileName);
     if (f.open(QIODevice::ReadOnly | QIODevice::Text)) {
         shader.source = f.readAll();
@@ -197,48 +411,368 @@ bool QOpenGLCacheableShaderProgram::addCacheableShaderFromSourceFile(QOpenGLShad
 bool QOpenGLCacheableShaderProgram::link()
 {
     qCDebug(DBG_SHADER_CACHE, "link() program %u", programId());
-    bool needsSave = false;
-    QByteArray cacheKey;
-    if (!d->program.shaders.isEmpty()) {
-        QCryptographicHash keyBuilder(QCryptographicHash::Sha1);
-        for (const QOpenGLProgramBinaryCache::ShaderDesc &shader : qAsConst(d->program.shaders))
-            keyBuilder.addData(shader.source);
-        cacheKey = keyBuilder.result().toHex();
-        if (DBG_SHADER_CACHE().isEnabled(QtDebugMsg))
-            qCDebug(DBG_SHADER_CACHE, "program with %d shaders, cache key %s",
-                    d->program.shaders.count(), cacheKey.constData());
-        if (qt_gl_program_binary_cache()->load(cacheKey, programId())) {
-            qCDebug(DBG_SHADER_CACHE, "Program binary received from cache");
-            if (!QOpenGLShaderProgram::link()) {
-                qCDebug(DBG_SHADER_CACHE, "Link failed after glProgramBinary; compiling from scratch");
-                if (d->compileCacheable())
-                    needsSave = true;
-                else
-                    return false;
-            }
-        } else {
-            qCDebug(DBG_SHADER_CACHE, "Program binary not in cache, compiling");
-            if (d->compileCacheable())
-                needsSave = true;
+    if (d->program.shaders.isEmpty()) {
+        if (d->hasReleasedSources())
+            return d->relinkFromCache();
+        qCDebug(DBG_SHADER_CACHE, "Not a binary-based program");
+        return QOpenGLShaderProgram::link();
+    }
+
+    if (d->buildCacheKey() && d->loadFromCache()) {
+        d->releaseSourcesIfCached();
+        return true;
+    }
+
+    return d->compileLinkAndSave();
+}
+
+// Links a set of programs, typically everything created at startup, in one go.
+// All cache keys are computed first and the corresponding entries are read on
+// a worker thread while the GL thread feeds glProgramBinary with the ones that
+// have arrived. The misses then get all their shaders compiled and linked
+// before any status is queried, so that drivers with
+// GL_KHR_parallel_shader_compile or GL_ARB_parallel_shader_compile can work on
+// them concurrently. Results are collected in completion order and saved to
+// the cache. Returns false if any of the programs failed to link.
+bool QOpenGLCacheableShaderProgram::linkAll(const QVector<QOpenGLCacheableShaderProgram *> &programs)
+{
+    QOpenGLContext *ctx = QOpenGLContext::currentContext();
+    if (!ctx)
+        return false;
+    QOpenGLProgramBinarySupportCheck *support = qt_gl_program_binary_support_check()->get(ctx);
+
+    QVector<QByteArray> cacheKeys;
+    for (QOpenGLCacheableShaderProgram *program : programs) {
+        if (!program->d->program.shaders.isEmpty() && program->d->buildCacheKey())
+            cacheKeys.append(program->d->cacheKey);
+    }
+    if (!cacheKeys.isEmpty())
+        qt_gl_program_binary_cache()->prefetch(support, cacheKeys);
+
+    bool ok = true;
+    QVector<QOpenGLCacheableShaderProgram *> pending;
+    for (QOpenGLCacheableShaderProgram *program : programs) {
+        QOpenGLCacheableShaderProgramPrivate *pd = program->d;
+        qCDebug(DBG_SHADER_CACHE, "linkAll() program %u", program->programId());
+        if (pd->program.shaders.isEmpty()) {
+            if (!(pd->hasReleasedSources() ? pd->relinkFromCache() : program->QOpenGLShaderProgram::link()))
+                ok = false;
+        } else if (!pd->cacheKey.isEmpty() && pd->loadFromCache()) {
+            pd->releaseSourcesIfCached();
+        } else if (support->hasParallelShaderCompile()) {
+            if (pd->dispatchCompileAndLink())
+                pending.append(program);
             else
-                return false;
+                ok = false;
+        } else if (!pd->compileLinkAndSave()) {
+            ok = false;
         }
-    } else {
-        qCDebug(DBG_SHADER_CACHE, "Not a binary-based program");
     }
 
-    bool ok = QOpenGLShaderProgram::link();
-    if (ok && needsSave)
-        qt_gl_program_binary_cache()->save(cacheKey, programId());
+    if (!cacheKeys.isEmpty())
+        qt_gl_program_binary_cache()->dropPrefetched(cacheKeys);
+
+    qCDebug(DBG_SHADER_CACHE, "linkAll() waiting for %d programs", pending.count());
+    while (!pending.isEmpty()) {
+        int i = 0;
+        while (i < pending.count() && !pending[i]->d->isDispatchedLinkComplete())
+            ++i;
+        if (i == pending.count())
+            i = 0; // nothing finished yet, block on the oldest one
+        if (!pending.takeAt(i)->d->finishDispatchedLink())
+            ok = false;
+    }
 
     return ok;
 }
 
+// Links on a background thread, so that programs needed in the middle of a
+// session do not stall the thread rendering frames. The cache lookup, and the
+// compile, link and save on a miss all happen there, on a context sharing with
+// the current one. When the returned future has finished, the program is back
+// in its thread and ready to bind. Until then it must not be used or deleted.
+// Needs initializeAsyncLinking(), and a program without a QObject parent;
+// otherwise this links right away.
+QFuture<bool> QOpenGLCacheableShaderProgram::linkAsync()
+{
+    QFutureInterface<bool> result;
+    result.reportStarted();
+    QOpenGLAsyncLinker *linker = qt_gl_async_linker.loadAcquire();
+    if (!linker || parent() || !QOpenGLContext::currentContext()) {
+        result.reportResult(link());
+        result.reportFinished();
+        return result.future();
+    }
+
+    // Created here, so that the program belongs to the calling thread's
+    // context as far as QOpenGLShaderProgram is concerned.
+    if (!create()) {
+        result.reportResult(false);
+        result.reportFinished();
+        return result.future();
+    }
+    qCDebug(DBG_SHADER_CACHE, "linkAsync() program %u", programId());
+    linker->enqueue(QVector<QOpenGLCacheableShaderProgram *>() << this, false, result);
+    return result.future();
+}
+
+// Links the given programs, typically the variants a material is going to
+// need, only to get their binaries into the cache, so that linking them later
+// is a cache hit. Takes ownership of the programs, which must have no QObject
+// parent. Runs on the asynchronous linking thread when there is one (see
+// initializeAsyncLinking()), otherwise right away on the current context.
+QFuture<bool> QOpenGLCacheableShaderProgram::precompile(const QVector<QOpenGLCacheableShaderProgram *> &programs)
+{
+    QFutureInterface<bool> result;
+    result.reportStarted();
+    QOpenGLAsyncLinker *linker = qt_gl_async_linker.loadAcquire();
+    bool async = linker != nullptr;
+    for (QOpenGLCacheableShaderProgram *program : programs)
+        async = async && !program->parent();
+    if (!async) {
+        result.reportResult(QOpenGLContext::currentContext() && linkAll(programs));
+        qDeleteAll(programs);
+        result.reportFinished();
+        return result.future();
+    }
+
+    qCDebug(DBG_SHADER_CACHE, "precompile() %d programs", programs.count());
+    linker->enqueue(programs, true, result);
+    return result.future();
+}
+
+// Sets up the thread and context linkAsync() uses. Must be called on the GUI
+// thread, before the first linkAsync(). shareContext is the context the
+// programs are going to be used with, by default the global share context
+// (Qt::AA_ShareOpenGLContexts). Returns false if no sharing context could be
+// created; linkAsync() then links synchronously.
+bool QOpenGLCacheableShaderProgram::initializeAsyncLinking(QOpenGLContext *shareContext)
+{
+    if (qt_gl_async_linker.loadAcquire())
+        return true;
+    if (!shareContext)
+        shareContext = QOpenGLContext::globalShareContext();
+    if (!shareContext) {
+        qWarning("QOpenGLCacheableShaderProgram: No context to share with for asynchronous linking");
+        return false;
+    }
+
+    QOpenGLContext *context = new QOpenGLContext;
+    context->setFormat(shareContext->format());
+    context->setShareContext(shareContext);
+    if (!context->create() || !QOpenGLContext::areSharing(context, shareContext)) {
+        qWarning("QOpenGLCacheableShaderProgram: Failed to create a shared context for asynchronous linking");
+        delete context;
+        return false;
+    }
+    QOffscreenSurface *surface = new QOffscreenSurface;
+    surface->setFormat(context->format());
+    surface->create();
+
+    QOpenGLAsyncLinker *linker = new QOpenGLAsyncLinker(context, surface);
+    linker->start();
+    qt_gl_async_linker.storeRelease(linker);
+    if (QCoreApplication *app = QCoreApplication::instance()) {
+        QObject::connect(app, &QCoreApplication::aboutToQuit, [] {
+            delete qt_gl_async_linker.fetchAndStoreAcquire(nullptr);
+        });
+    }
+    return true;
+}
+
+// Upper bound for the on-disk cache of the current driver, in bytes. 0 (the
+// default, unless QT_SHADER_CACHE_MAX_SIZE is set) means unlimited. Least
+// recently used entries are evicted on a background thread.
+void QOpenGLCacheableShaderProgram::setDiskCacheSizeLimit(qint64 bytes)
+{
+    qt_gl_program_binary_cache()->setMaxDiskSize(bytes);
+}
+
+qint64 QOpenGLCacheableShaderProgram::diskCacheSizeLimit()
+{
+    return qt_gl_program_binary_cache()->maxDiskSize();
+}
+
+// Budget, in bytes, for program binaries kept in memory for repeated loads
+// within the process. Defaults to 8 MB unless QT_SHADER_CACHE_MEMORY_SIZE is set.
+void QOpenGLCacheableShaderProgram::setMemoryCacheSizeLimit(qint64 bytes)
+{
+    qt_gl_program_binary_cache()->setMaxMemorySize(bytes);
+}
+
+qint64 QOpenGLCacheableShaderProgram::memoryCacheSizeLimit()
+{
+    return qt_gl_program_binary_cache()->maxMemorySize();
+}
+
+// Whether programs that load from disk no faster than they compile and link
+// stop being cached, and with them the disk cache of a driver where that holds
+// for most programs. On by default unless QT_SHADER_CACHE_ADAPTIVE=0.
+void QOpenGLCacheableShaderProgram::setAdaptiveCaching(bool enable)
+{
+    qt_gl_program_binary_cache()->setAdaptive(enable);
+}
+
+bool QOpenGLCacheableShaderProgram::adaptiveCaching()
+{
+    return qt_gl_program_binary_cache()->isAdaptive();
+}
+
+// Bytes currently held by the in-memory cache.
+qint64 QOpenGLCacheableShaderProgram::memoryCacheSize()
+{
+    return qt_gl_program_binary_cache()->memorySize();
+}
+
+// Starts reading the entries the previous run used into the memory cache on a
+// background thread. Needs no context, so it can be called (or requested with
+// QT_SHADER_CACHE_WARMUP=1) right at startup to overlap the disk access with
+// window and context creation.
+void QOpenGLCacheableShaderProgram::warmUpCache()
+{
+    qt_gl_program_binary_cache()->warmUp();
+}
+
+// Counters and timings of the cache and of the compiles it falls back to, as
+// JSON. The same is written at exit to the file named by QT_SHADER_CACHE_STATS.
+QJsonObject QOpenGLCacheableShaderProgram::cacheStatistics()
+{
+    return qt_gl_program_binary_cache()->stats()->toJson();
+}
+
+void QOpenGLCacheableShaderProgram::resetCacheStatistics()
+{
+    qt_gl_program_binary_cache()->stats()->reset();
+}
+
+// Blocks until all pending cache writes are on disk. Happens automatically when
+// the application quits; needed only by code that never enters exec().
+void QOpenGLCacheableShaderProgram::flushCache()
+{
+    qt_gl_program_binary_cache()->flush();
+}
+
+bool QOpenGLCacheableShaderProgramPrivate::buildCacheKey()
+{
+    if (isCacheDisabled()) {
+        cacheKey.clear();
+        return false;
+    }
+
+    {
+        QOpenGLProgramBinaryCacheStats::Timing timing(qt_gl_program_binary_cache()->stats(),
+                                                      QOpenGLProgramBinaryCacheStats::HashTime);
+        cacheKey = QOpenGLProgramBinaryCache::cacheKey(program);
+    }
+    if (DBG_SHADER_CACHE().isEnabled(QtDebugMsg))
+        qCDebug(DBG_SHADER_CACHE, "program with %d shaders, cache key %s",
+                program.shaders.count(), cacheKey.toHex().constData());
+    return true;
+}
+
+bool QOpenGLCacheableShaderProgramPrivate::loadFromCache()
+{
+    if (!qt_gl_program_binary_cache()->load(supportCheck(), cacheKey, q->programId())) {
+        qCDebug(DBG_SHADER_CACHE, "Program binary not in cache, compiling");
+        return false;
+    }
+
+    // The binary is known to be linked at this point. With no shaders attached
+    // the base class only queries the status, and so records the program as
+    // linked without a glLinkProgram.
+    qCDebug(DBG_SHADER_CACHE, "Program binary received from cache");
+    return q->QOpenGLShaderProgram::link();
+}
+
+bool QOpenGLCacheableShaderProgramPrivate::linkCompiled()
+{
+    QOpenGLProgramBinaryCacheStats::Timing timing(qt_gl_program_binary_cache()->stats(),
+                                                  QOpenGLProgramBinaryCacheStats::LinkTime);
+    return q->QOpenGLShaderProgram::link();
+}
+
+// Only for binaries the cache is going to take, as the hint may cost the
+// driver time or memory.
+void QOpenGLCacheableShaderProgramPrivate::setRetrievableHint()
+{
+    QOpenGLProgramBinarySupportCheck *support = supportCheck();
+    if (!cacheKey.isEmpty() && qt_gl_program_binary_cache()->willSave(support, cacheKey))
+        support->setRetrievableHint(q->programId());
+}
+
+// The cache miss path of link(), and of linkAll() without parallel compiles.
+bool QOpenGLCacheableShaderProgramPrivate::compileLinkAndSave()
+{
+    buildTimer.start();
+    if (!compileCacheable())
+        return false;
+
+    setRetrievableHint();
+    if (!linkCompiled())
+        return false;
+
+    saveToCache();
+    releaseSources();
+    return true;
+}
+
+// Returns whether the cache took the binary, which the adaptive policy may
+// decline for programs that build faster than they load.
+bool QOpenGLCacheableShaderProgramPrivate::saveToCache()
+{
+    if (cacheKey.isEmpty())
+        return false;
+    return qt_gl_program_binary_cache()->save(supportCheck(), cacheKey, q->programId(),
+                                              buildTimer.isValid() ? buildTimer.nsecsElapsed() : 0);
+}
+
+// Once linked, a program needs its sources no more if it has compiled shader
+// objects attached, or can be relinked by loading the binary again. Only the
+// key is kept, so that long-lived programs do not pin their GLSL.
+void QOpenGLCacheableShaderProgramPrivate::releaseSources()
+{
+    program.shaders.clear();
+    program.shaders.squeeze();
+}
+
+// For a program without shader objects, which a later link() can only restore
+// from the cache. Its sources are kept, to compile from, unless the cache is
+// sure to still have the binary then.
+void QOpenGLCacheableShaderProgramPrivate::releaseSourcesIfCached()
+{
+    if (qt_gl_program_binary_cache()->keepsEntries())
+        releaseSources();
+}
+
+bool QOpenGLCacheableShaderProgramPrivate::hasReleasedSources()
+{
+    return !cacheKey.isEmpty() && q->shaders().isEmpty();
+}
+
+bool QOpenGLCacheableShaderProgramPrivate::relinkFromCache()
+{
+    // Still linked: the base class only picks up the status then, and nothing
+    // needs loading.
+    if (q->isLinked() && q->QOpenGLShaderProgram::link())
+        return true;
+    if (loadFromCache())
+        return true;
+    qWarning("QOpenGLCacheableShaderProgram: Cannot relink program %u, its binary is no longer cached "
+             "and the sources were released", q->programId());
+    return false;
+}
+
 bool QOpenGLCacheableShaderProgramPrivate::compileCacheable()
 {
+    QOpenGLProgramBinaryCacheStats::Timing timing(qt_gl_program_binary_cache()->stats(),
+                                                  QOpenGLProgramBinaryCacheStats::CompileTime);
     for (const QOpenGLProgramBinaryCache::ShaderDesc &shader : qAsConst(program.shaders)) {
         QOpenGLShader *s = new QOpenGLShader(shader.type, q);
-        if (!s->compileSourceCode(shader.source)) {
+        // compileSourceCode() wants a terminated string, which raw data
+        // (resources, fromRawData() literals) need not be.
+        const QByteArray source = variantSource(shader);
+        const bool raw = source.capacity() < source.size();
+        if (!s->compileSourceCode(raw ? QByteArray(source.constData(), source.size()) : source)) {
             qWarning() << s->log();
             // ### update base d->log
             return false;
@@ -248,4 +782,137 @@ bool QOpenGLCacheableShaderProgramPrivate::compileCacheable()
     return true;
 }
 
+static GLenum glShaderType(QOpenGLShader::ShaderType type)
+{
+    switch (type) {
+    case QOpenGLShader::Vertex:
+        return GL_VERTEX_SHADER;
+    case QOpenGLShader::Fragment:
+        return GL_FRAGMENT_SHADER;
+    case QOpenGLShader::Geometry:
+        return GL_GEOMETRY_SHADER;
+    case QOpenGLShader::TessellationControl:
+        return GL_TESS_CONTROL_SHADER;
+    case QOpenGLShader::TessellationEvaluation:
+        return GL_TESS_EVALUATION_SHADER;
+    case QOpenGLShader::Compute:
+        return GL_COMPUTE_SHADER;
+    default:
+        return 0;
+    }
+}
+
+// Mirrors what QOpenGLShader::compileSourceCode() does to a source, minus the
+// driver specific workarounds: on desktop OpenGL the precision qualifiers are
+// defined away, right after the #version directive if there is one.
+static QByteArray prepareShaderSource(QOpenGLContext *ctx, const QByteArray &source)
+{
+    if (ctx->isOpenGLES())
+        return source;
+
+    int versionLine;
+    const int versionEnd = versionDirectiveEnd(source, &versionLine);
+    const int len = source.size();
+    const char *s = source.constData();
+
+    static const char qualifierDefines[] =
+        "#define lowp\n"
+        "#define mediump\n"
+        "#define highp\n";
+
+    QByteArray result;
+    result.reserve(len + int(sizeof(qualifierDefines)) + 16);
+    result.append(s, versionEnd);
+    result.append(qualifierDefines);
+    result.append("#line ");
+    result.append(QByteArray::number(versionLine + 1));
+    result.append('\n');
+    result.append(s + versionEnd, len - versionEnd);
+    return result;
+}
+
+// Issues the compile and link commands without querying any status, which
+// would make the driver wait for the result. The build time stored with the
+// binary then also includes waiting for other programs, so errs on the side
+// of caching.
+bool QOpenGLCacheableShaderProgramPrivate::dispatchCompileAndLink()
+{
+    buildTimer.start();
+    QOpenGLProgramBinaryCacheStats::Timing timing(qt_gl_program_binary_cache()->stats(),
+                                                  QOpenGLProgramBinaryCacheStats::CompileTime);
+    QOpenGLContext *ctx = QOpenGLContext::currentContext();
+    QOpenGLExtraFunctions *f = ctx->extraFunctions();
+    const GLuint programId = q->programId();
+    for (const QOpenGLProgramBinaryCache::ShaderDesc &shader : qAsConst(program.shaders)) {
+        const GLuint shaderId = f->glCreateShader(glShaderType(shader.type));
+        if (!shaderId) {
+            qWarning("QOpenGLCacheableShaderProgram: Could not create shader of type %d", int(shader.type));
+            for (GLuint s : qAsConst(dispatchedShaders))
+                f->glDeleteShader(s);
+            dispatchedShaders.clear();
+            return false;
+        }
+        const QByteArray src = prepareShaderSource(ctx, variantSource(shader));
+        const char *srcData = src.constData();
+        const GLint srcLength = src.size();
+        f->glShaderSource(shaderId, 1, &srcData, &srcLength);
+        f->glCompileShader(shaderId);
+        f->glAttachShader(programId, shaderId);
+        dispatchedShaders.append(shaderId);
+    }
+    setRetrievableHint();
+    f->glLinkProgram(programId);
+    return true;
+}
+
+bool QOpenGLCacheableShaderProgramPrivate::isDispatchedLinkComplete()
+{
+    GLint done = 0;
+    QOpenGLContext::currentContext()->functions()->glGetProgramiv(q->programId(), GL_COMPLETION_STATUS_KHR, &done);
+    return done;
+}
+
+// The link time of a dispatched program includes waiting for its compilation.
+bool QOpenGLCacheableShaderProgramPrivate::finishDispatchedLink()
+{
+    QOpenGLProgramBinaryCacheStats::Timing timing(qt_gl_program_binary_cache()->stats(),
+                                                  QOpenGLProgramBinaryCacheStats::LinkTime);
+    QOpenGLExtraFunctions *f = QOpenGLContext::currentContext()->extraFunctions();
+    const GLuint programId = q->programId();
+    GLint linked = 0;
+    f->glGetProgramiv(programId, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        for (GLuint shaderId : qAsConst(dispatchedShaders)) {
+            GLint compiled = 0;
+            f->glGetShaderiv(shaderId, GL_COMPILE_STATUS, &compiled);
+            if (!compiled) {
+                char log[1024];
+                GLsizei logLength = 0;
+                f->glGetShaderInfoLog(shaderId, sizeof(log), &logLength, log);
+                qWarning("QOpenGLCacheableShaderProgram: Shader compilation failed: %.*s", int(logLength), log);
+            }
+        }
+        char log[1024];
+        GLsizei logLength = 0;
+        f->glGetProgramInfoLog(programId, sizeof(log), &logLength, log);
+        qWarning("QOpenGLCacheableShaderProgram: Link failed: %.*s", int(logLength), log);
+    }
+    for (GLuint shaderId : qAsConst(dispatchedShaders)) {
+        f->glDetachShader(programId, shaderId);
+        f->glDeleteShader(shaderId);
+    }
+    dispatchedShaders.clear();
+    if (!linked)
+        return false;
+
+    // There are no QOpenGLShaders attached, so this only picks up the link status.
+    if (!q->QOpenGLShaderProgram::link())
+        return false;
+
+    // Without shader objects a relink has to come from the cache.
+    if (saveToCache())
+        releaseSourcesIfCached();
+    return true;
+}
+
 QT_END_NAMESPACE
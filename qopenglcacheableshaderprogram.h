@@ -45,6 +45,10 @@
 #ifndef QT_NO_OPENGL
 
 #include <QtGui/qopenglshaderprogram.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qjsonobject.h>
+#include <QtCore/qfuture.h>
+#include <QtCore/qbytearraylist.h>
 
 QT_BEGIN_NAMESPACE
 
@@ -60,8 +64,31 @@ public:
     bool addCacheableShaderFromSourceCode(QOpenGLShader::ShaderType type, const QByteArray &source);
     bool addCacheableShaderFromSourceCode(QOpenGLShader::ShaderType type, const QString &source);
     bool addCacheableShaderFromSourceFile(QOpenGLShader::ShaderType type, const QString &fileName);
+    bool addCacheableShaderVariant(QOpenGLShader::ShaderType type, const QByteArray &source,
+                                   const QByteArrayList &defines);
 
     bool link() override;
+    static bool linkAll(const QVector<QOpenGLCacheableShaderProgram *> &programs);
+
+    QFuture<bool> linkAsync();
+    static bool initializeAsyncLinking(QOpenGLContext *shareContext = nullptr);
+    static QFuture<bool> precompile(const QVector<QOpenGLCacheableShaderProgram *> &programs);
+
+    static void setDiskCacheSizeLimit(qint64 bytes);
+    static qint64 diskCacheSizeLimit();
+
+    static void setMemoryCacheSizeLimit(qint64 bytes);
+    static qint64 memoryCacheSizeLimit();
+    static qint64 memoryCacheSize();
+
+    static void setAdaptiveCaching(bool enable);
+    static bool adaptiveCaching();
+
+    static void warmUpCache();
+    static void flushCache();
+
+    static QJsonObject cacheStatistics();
+    static void resetCacheStatistics();
 
 private:
     QOpenGLCacheableShaderProgramPrivate *d;
@@ -1,7 +1,7 @@
 TEMPLATE = app
 CONFIG += console
 
-SOURCES = main.cpp qopenglcacheableshaderprogram.cpp qopenglprogrambinarycache.cpp
-HEADERS = qopenglcacheableshaderprogram.h qopenglprogrambinarycache_p.h
+SOURCES = main.cpp qopenglcacheableshaderprogram.cpp qopenglprogrambinarycache.cpp qopenglprogrambinarypack.cpp qopenglshaderhash.cpp qopengllz4.cpp
+HEADERS = qopenglcacheableshaderprogram.h qopenglprogrambinarycache_p.h qopenglprogrambinarypack_p.h qopenglshaderhash_p.h qopengllz4_p.h
 
 QT += core-private gui-private
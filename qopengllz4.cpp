@@ -0,0 +1,213 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the QtGui module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see https://www.qt.io/terms-conditions. For further
+** information use the contact form at https://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl-3.0.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or (at your option) the GNU General
+** Public license version 3 or any later version approved by the KDE Free
+** Qt Foundation. The licenses are as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL2 and LICENSE.GPL3
+** included in the packaging of this file. Please review the following
+** information to ensure the GNU General Public License requirements will
+** be met: https://www.gnu.org/licenses/gpl-2.0.html and
+** https://www.gnu.org/licenses/gpl-3.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qopengllz4_p.h"
+#include <string.h>
+
+QT_BEGIN_NAMESPACE
+
+// A block is a series of sequences: a token with the literal length (high
+// nibble) and the match length minus 4 (low nibble), 255-continued lengths,
+// the literals, and a little endian 16-bit match offset. The last sequence
+// has literals only; the format requires the last 5 bytes to be literals and
+// the last match to start at least 12 bytes before the end.
+
+static const int MIN_MATCH = 4;
+static const int LAST_LITERALS = 5;
+static const int MF_LIMIT = 12;
+static const int MAX_OFFSET = 65535;
+static const int HASH_BITS = 14;
+
+static inline quint32 read32(const uchar *p)
+{
+    quint32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline quint32 hash4(quint32 v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline bool writeLength(uchar **op, const uchar *end, int len)
+{
+    for ( ; len >= 255; len -= 255) {
+        if (*op >= end)
+            return false;
+        *(*op)++ = 255;
+    }
+    if (*op >= end)
+        return false;
+    *(*op)++ = uchar(len);
+    return true;
+}
+
+static bool writeSequence(uchar **op, const uchar *end, const uchar *literals, int literalLength,
+                          int offset, int matchLength)
+{
+    if (*op >= end)
+        return false;
+    uchar *token = (*op)++;
+    *token = uchar(qMin(literalLength, 15) << 4);
+    if (literalLength >= 15 && !writeLength(op, end, literalLength - 15))
+        return false;
+    if (end - *op < literalLength)
+        return false;
+    memcpy(*op, literals, literalLength);
+    *op += literalLength;
+    if (!offset)
+        return true;
+
+    if (end - *op < 2)
+        return false;
+    *(*op)++ = uchar(offset);
+    *(*op)++ = uchar(offset >> 8);
+    matchLength -= MIN_MATCH;
+    *token |= uchar(qMin(matchLength, 15));
+    return matchLength < 15 || writeLength(op, end, matchLength - 15);
+}
+
+int QOpenGLLz4::compress(const uchar *src, int srcSize, uchar *dst, int dstCapacity)
+{
+    uchar *op = dst;
+    const uchar *end = dst + dstCapacity;
+    int anchor = 0;
+
+    if (srcSize > MF_LIMIT) {
+        int *table = new int[1 << HASH_BITS];
+        for (int i = 0; i < (1 << HASH_BITS); ++i)
+            table[i] = -1;
+        const int matchLimit = srcSize - LAST_LITERALS;
+        const int lastMatchStart = srcSize - MF_LIMIT;
+        int ip = 0;
+        while (ip <= lastMatchStart) {
+            const quint32 h = hash4(read32(src + ip));
+            int ref = table[h];
+            table[h] = ip;
+            if (ref < 0 || ip - ref > MAX_OFFSET || read32(src + ref) != read32(src + ip)) {
+                // Step faster through data that does not compress.
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                --ip;
+                --ref;
+            }
+            int len = MIN_MATCH;
+            while (ip + len < matchLimit && src[ref + len] == src[ip + len])
+                ++len;
+            if (!writeSequence(&op, end, src + anchor, ip - anchor, ip - ref, len)) {
+                delete[] table;
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+            if (ip - 2 <= lastMatchStart)
+                table[hash4(read32(src + ip - 2))] = ip - 2;
+        }
+        delete[] table;
+    }
+
+    if (!writeSequence(&op, end, src + anchor, srcSize - anchor, 0, 0))
+        return 0;
+    return int(op - dst);
+}
+
+bool QOpenGLLz4::decompress(const uchar *src, int srcSize, uchar *dst, int dstSize)
+{
+    const uchar *ip = src;
+    const uchar *const ipEnd = src + srcSize;
+    uchar *op = dst;
+    uchar *const opEnd = dst + dstSize;
+
+    while (ip < ipEnd) {
+        const int token = *ip++;
+
+        qint64 literalLength = token >> 4;
+        if (literalLength == 15) {
+            int b;
+            do {
+                if (ip >= ipEnd)
+                    return false;
+                b = *ip++;
+                literalLength += b;
+            } while (b == 255);
+        }
+        if (ipEnd - ip < literalLength || opEnd - op < literalLength)
+            return false;
+        memcpy(op, ip, size_t(literalLength));
+        ip += literalLength;
+        op += literalLength;
+        if (ip == ipEnd)
+            break;
+
+        if (ipEnd - ip < 2)
+            return false;
+        const int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > op - dst)
+            return false;
+
+        qint64 matchLength = token & 15;
+        if (matchLength == 15) {
+            int b;
+            do {
+                if (ip >= ipEnd)
+                    return false;
+                b = *ip++;
+                matchLength += b;
+            } while (b == 255);
+        }
+        matchLength += MIN_MATCH;
+        if (opEnd - op < matchLength)
+            return false;
+        const uchar *match = op - offset;
+        if (offset >= matchLength) {
+            memcpy(op, match, size_t(matchLength));
+            op += matchLength;
+        } else {
+            while (matchLength--)
+                *op++ = *match++;
+        }
+    }
+    return op == opEnd;
+}
+
+QT_END_NAMESPACE
@@ -38,14 +38,32 @@
 ****************************************************************************/
 
 #include "qopenglprogrambinarycache_p.h"
+#include "qopenglprogrambinarypack_p.h"
+#include "qopenglshaderhash_p.h"
+#include "qopengllz4_p.h"
 #include <QOpenGLContext>
 #include <QOpenGLExtraFunctions>
 #include <QStandardPaths>
 #include <QDir>
+#include <QDateTime>
 #include <QLoggingCategory>
+#include <QCryptographicHash>
+#include <QCoreApplication>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QVarLengthArray>
+#include <QtEndian>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <limits>
 
 #ifdef Q_OS_UNIX
 #include <sys/mman.h>
+#include <utime.h>
 #include <private/qcore_unix_p.h>
 #endif
 
@@ -57,48 +75,953 @@ Q_DECLARE_LOGGING_CATEGORY(DBG_SHADER_CACHE)
 #define GL_PROGRAM_BINARY_LENGTH          0x8741
 #endif
 
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS     0x87FE
+#endif
+
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+
 // all of QOpenGLProgramBinaryCache must be thread-safe
 
 const quint32 BINSHADER_MAGIC = 0x5174;
-const quint32 BINSHADER_VERSION = 0x1;
+const quint32 BINSHADER_VERSION = 0x3;
 const quint32 BINSHADER_QTVERSION = QT_VERSION;
+// Bumped whenever the way keys are derived from sources changes.
+const quint32 BINSHADER_KEYVERSION = 0x1;
+// Or'ed into the version: the binary is LZ4 compressed, and its uncompressed
+// size follows the stored one.
+const quint32 BINSHADER_FLAG_LZ4 = 0x10000;
+const quint32 BINSHADER_FLAGS_MASK = 0xFFFF0000;
 
-struct GLEnvInfo
+QOpenGLProgramBinarySupportCheck::QOpenGLProgramBinarySupportCheck(QOpenGLContext *context)
+    : QOpenGLSharedResource(context->shareGroup()),
+      m_supported(false),
+      m_parallelShaderCompile(false),
+      m_getProgramBinaryOES(nullptr),
+      m_programBinaryOES(nullptr)
 {
-    GLEnvInfo();
+    QOpenGLContext *ctx = QOpenGLContext::currentContext();
+    if (!ctx)
+        return;
+
+    // Independent of the binary cache: programs are still compiled in parallel
+    // by linkAll() when there is nothing to cache them with.
+    const bool khrParallel = ctx->hasExtension("GL_KHR_parallel_shader_compile");
+    if (khrParallel || ctx->hasExtension("GL_ARB_parallel_shader_compile")) {
+        typedef void (QOPENGLF_APIENTRYP MaxShaderCompilerThreads)(GLuint count);
+        MaxShaderCompilerThreads maxShaderCompilerThreads = reinterpret_cast<MaxShaderCompilerThreads>(
+                    ctx->getProcAddress(khrParallel ? "glMaxShaderCompilerThreadsKHR" : "glMaxShaderCompilerThreadsARB"));
+        if (maxShaderCompilerThreads) {
+            maxShaderCompilerThreads(0xFFFFFFFF); // let the implementation decide
+            m_parallelShaderCompile = true;
+        }
+    }
+    qCDebug(DBG_SHADER_CACHE, "Parallel shader compile support = %d", m_parallelShaderCompile);
+
+    if (qEnvironmentVariableIntValue("QT_DISABLE_SHADER_CACHE") == 0) {
+        if (ctx->isOpenGLES()) {
+            qCDebug(DBG_SHADER_CACHE, "OpenGL ES v%d context", ctx->format().majorVersion());
+            if (ctx->format().majorVersion() >= 3) {
+                m_supported = true;
+            } else if (ctx->hasExtension("GL_OES_get_program_binary")) {
+                m_getProgramBinaryOES = reinterpret_cast<GetProgramBinaryOES>(ctx->getProcAddress("glGetProgramBinaryOES"));
+                m_programBinaryOES = reinterpret_cast<ProgramBinaryOES>(ctx->getProcAddress("glProgramBinaryOES"));
+                m_supported = m_getProgramBinaryOES && m_programBinaryOES;
+                qCDebug(DBG_SHADER_CACHE, "GL_OES_get_program_binary support = %d", m_supported);
+            }
+        } else {
+            const bool hasExt = ctx->hasExtension("GL_ARB_get_program_binary");
+            qCDebug(DBG_SHADER_CACHE, "GL_ARB_get_program_binary support = %d", hasExt);
+            if (hasExt)
+                m_supported = true;
+        }
+        if (m_supported) {
+            // Same value as GL_NUM_PROGRAM_BINARY_FORMATS_OES.
+            GLint fmtCount = 0;
+            ctx->functions()->glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &fmtCount);
+            qCDebug(DBG_SHADER_CACHE, "Supported binary format count = %d", fmtCount);
+            m_supported = fmtCount > 0;
+        }
+        if (m_supported) {
+            // Computed once per share group. Includes the terminators so
+            // that the boundaries between the strings are part of the hash.
+            QCryptographicHash hash(QCryptographicHash::Sha1);
+            const quint32 format[] = { BINSHADER_MAGIC, BINSHADER_VERSION, BINSHADER_QTVERSION, BINSHADER_KEYVERSION };
+            hash.addData(reinterpret_cast<const char *>(format), sizeof(format));
+            for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+                const char *s = reinterpret_cast<const char *>(ctx->functions()->glGetString(name));
+                if (!s)
+                    s = "";
+                hash.addData(s, int(qstrlen(s)) + 1);
+            }
+            m_fingerprint = hash.result().toHex();
+            qCDebug(DBG_SHADER_CACHE, "Driver fingerprint %s", m_fingerprint.constData());
+        }
+        qCDebug(DBG_SHADER_CACHE, "Shader cache supported = %d", m_supported);
+    } else {
+        qCDebug(DBG_SHADER_CACHE, "Shader cache disabled via env var");
+    }
+}
 
-    QByteArray glvendor;
-    QByteArray glrenderer;
-    QByteArray glversion;
+// File I/O for save() and eviction happen here, off the GL thread. The queue is
+// bounded by bytes; a producer that would exceed it waits for the writer to catch up.
+class QOpenGLProgramBinaryWriter : public QThread
+{
+public:
+    QOpenGLProgramBinaryWriter(QOpenGLProgramBinaryCache *cache)
+        : m_cache(cache),
+          m_queuedBytes(0),
+          m_busy(false),
+          m_stop(false)
+    {
+        setObjectName(QStringLiteral("QOpenGLProgramBinaryWriter"));
+    }
+    ~QOpenGLProgramBinaryWriter();
+
+    void enqueue(QOpenGLProgramBinaryCache::Namespace *ns, const QByteArray &cacheKey, const QByteArray &data);
+    void enqueueEviction(QOpenGLProgramBinaryCache::Namespace *ns);
+    void enqueueRejection(QOpenGLProgramBinaryCache::Namespace *ns, const QByteArray &cacheKey);
+    void enqueueRemoval(QOpenGLProgramBinaryCache::Namespace *ns, const QByteArray &cacheKey);
+    void enqueuePolicy(QOpenGLProgramBinaryCache::Namespace *ns);
+    void enqueueStamp(QOpenGLProgramBinaryCache::Namespace *ns);
+    void enqueuePurge();
+    void flush();
+
+protected:
+    void run() override;
+
+private:
+    struct Job {
+        enum Type {
+            Write,
+            Evict,
+            Reject,
+            Remove,
+            Policy,
+            Stamp,
+            Purge
+        };
+        Type type;
+        QOpenGLProgramBinaryCache::Namespace *ns;
+        QByteArray cacheKey;
+        QByteArray data;
+    };
+
+    QOpenGLProgramBinaryCache *m_cache;
+    QMutex m_lock;
+    QWaitCondition m_workAvailable;
+    QWaitCondition m_workDone;
+    void add(const Job &job);
+
+    QQueue<Job> m_queue;
+    qint64 m_queuedBytes;
+    bool m_busy;
+    bool m_stop;
 };
 
-GLEnvInfo::GLEnvInfo()
+static const qint64 MAX_QUEUED_WRITE_BYTES = 8 * 1024 * 1024;
+// Likewise for entries read ahead but not consumed by load() yet.
+static const qint64 MAX_PREFETCHED_BYTES = 8 * 1024 * 1024;
+
+QOpenGLProgramBinaryWriter::~QOpenGLProgramBinaryWriter()
 {
-    QOpenGLContext *ctx = QOpenGLContext::currentContext();
-    Q_ASSERT(ctx);
-    QOpenGLFunctions *f = ctx->functions();
-    const char *vendor = reinterpret_cast<const char *>(f->glGetString(GL_VENDOR));
-    const char *renderer = reinterpret_cast<const char *>(f->glGetString(GL_RENDERER));
-    const char *version = reinterpret_cast<const char *>(f->glGetString(GL_VERSION));
-    if (vendor)
-        glvendor = QByteArray(vendor);
-    if (renderer)
-        glrenderer = QByteArray(renderer);
-    if (version)
-        glversion = QByteArray(version);
+    {
+        QMutexLocker locker(&m_lock);
+        m_stop = true;
+        m_workAvailable.wakeAll();
+    }
+    wait();
+}
+
+void QOpenGLProgramBinaryWriter::enqueue(QOpenGLProgramBinaryCache::Namespace *ns, const QByteArray &cacheKey, const QByteArray &data)
+{
+    add({ Job::Write, ns, cacheKey, data });
+}
+
+void QOpenGLProgramBinaryWriter::enqueueEviction(QOpenGLProgramBinaryCache::Namespace *ns)
+{
+    add({ Job::Evict, ns, QByteArray(), QByteArray() });
+}
+
+void QOpenGLProgramBinaryWriter::enqueueRejection(QOpenGLProgramBinaryCache::Namespace *ns, const QByteArray &cacheKey)
+{
+    add({ Job::Reject, ns, cacheKey, QByteArray() });
+}
+
+void QOpenGLProgramBinaryWriter::enqueueRemoval(QOpenGLProgramBinaryCache::Namespace *ns, const QByteArray &cacheKey)
+{
+    add({ Job::Remove, ns, cacheKey, QByteArray() });
+}
+
+void QOpenGLProgramBinaryWriter::enqueuePolicy(QOpenGLProgramBinaryCache::Namespace *ns)
+{
+    add({ Job::Policy, ns, QByteArray(), QByteArray() });
+}
+
+void QOpenGLProgramBinaryWriter::enqueueStamp(QOpenGLProgramBinaryCache::Namespace *ns)
+{
+    add({ Job::Stamp, ns, QByteArray(), QByteArray() });
+}
+
+void QOpenGLProgramBinaryWriter::enqueuePurge()
+{
+    add({ Job::Purge, nullptr, QByteArray(), QByteArray() });
+}
+
+void QOpenGLProgramBinaryWriter::add(const Job &job)
+{
+    QMutexLocker locker(&m_lock);
+    while (!m_queue.isEmpty() && m_queuedBytes + job.data.size() > MAX_QUEUED_WRITE_BYTES)
+        m_workDone.wait(&m_lock);
+    m_queue.enqueue(job);
+    m_queuedBytes += job.data.size();
+    if (!isRunning())
+        start(QThread::LowPriority);
+    m_workAvailable.wakeOne();
+}
+
+void QOpenGLProgramBinaryWriter::flush()
+{
+    QMutexLocker locker(&m_lock);
+    while (!m_queue.isEmpty() || m_busy)
+        m_workDone.wait(&m_lock);
+}
+
+void QOpenGLProgramBinaryWriter::run()
+{
+    for (;;) {
+        Job job;
+        {
+            QMutexLocker locker(&m_lock);
+            while (m_queue.isEmpty() && !m_stop)
+                m_workAvailable.wait(&m_lock);
+            if (m_queue.isEmpty())
+                return;
+            job = m_queue.dequeue();
+            m_busy = true;
+        }
+
+        switch (job.type) {
+        case Job::Write:
+            m_cache->writeEntry(job.ns, job.cacheKey, job.data);
+            break;
+        case Job::Evict:
+            m_cache->evict(job.ns);
+            break;
+        case Job::Reject:
+            m_cache->writeRejection(job.ns, job.cacheKey);
+            break;
+        case Job::Remove:
+            m_cache->removeEntry(job.ns, job.cacheKey);
+            break;
+        case Job::Policy:
+            m_cache->writePolicy(job.ns);
+            break;
+        case Job::Stamp:
+            m_cache->stampNamespace(job.ns);
+            break;
+        case Job::Purge:
+            m_cache->purgeStale();
+            break;
+        }
+
+        QMutexLocker locker(&m_lock);
+        m_queuedBytes -= job.data.size();
+        m_busy = false;
+        m_workDone.wakeAll();
+    }
+}
+
+static const qint64 DEFAULT_MAX_MEMORY_SIZE = 8 * 1024 * 1024;
+
+// "1048576", "1024K", "1M", "1G"
+static qint64 parseSize(const QByteArray &s)
+{
+    const QByteArray v = s.trimmed().toUpper();
+    if (v.isEmpty())
+        return 0;
+    qint64 unit = 1;
+    int len = v.size();
+    switch (v.at(len - 1)) {
+    case 'G':
+        unit *= 1024;
+        Q_FALLTHROUGH();
+    case 'M':
+        unit *= 1024;
+        Q_FALLTHROUGH();
+    case 'K':
+        unit *= 1024;
+        --len;
+        break;
+    default:
+        break;
+    }
+    return qMax<qint64>(0, v.left(len).toLongLong() * unit);
 }
 
 QOpenGLProgramBinaryCache::QOpenGLProgramBinaryCache()
+    : m_writer(new QOpenGLProgramBinaryWriter(this))
 {
-    m_cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QLatin1String("/qtshadercache/");
+    // A shared directory may be used by several processes at the same time.
+    const QString sharedDir = QFile::decodeName(qgetenv("QT_SHADER_CACHE_SHARED_DIR"));
+    m_shared = !sharedDir.isEmpty();
+    const QString dir = m_shared ? sharedDir : QFile::decodeName(qgetenv("QT_SHADER_CACHE_DIR"));
+    if (dir.isEmpty())
+        m_cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QLatin1String("/qtshadercache/");
+    else
+        m_cacheDir = QDir(dir).absolutePath() + QLatin1Char('/');
     QDir::root().mkpath(m_cacheDir);
     m_cacheWritable = QFileInfo(m_cacheDir).isWritable();
-    qCDebug(DBG_SHADER_CACHE, "Cache location '%s' writable = %d", qPrintable(m_cacheDir), m_cacheWritable);
+    m_usePack = qEnvironmentVariableIntValue("QT_SHADER_CACHE_PACK");
+    m_compress = qEnvironmentVariableIntValue("QT_SHADER_CACHE_COMPRESS");
+    m_adaptive = !qEnvironmentVariableIsSet("QT_SHADER_CACHE_ADAPTIVE")
+            || qEnvironmentVariableIntValue("QT_SHADER_CACHE_ADAPTIVE");
+    // Off when the entries are produced for other machines, whose loads
+    // must not be weighed against the build times measured here.
+    m_storeBuildTimes = !qEnvironmentVariableIsSet("QT_SHADER_CACHE_BUILD_TIMES")
+            || qEnvironmentVariableIntValue("QT_SHADER_CACHE_BUILD_TIMES");
+    m_readerPool.setMaxThreadCount(1);
+    m_prefetchedBytes = 0;
+    m_maxDiskSize = parseSize(qgetenv("QT_SHADER_CACHE_MAX_SIZE"));
+    m_maxMemorySize = 0;
+    const qint64 memSize = parseSize(qgetenv("QT_SHADER_CACHE_MEMORY_SIZE"));
+    setMaxMemorySize(memSize ? memSize : DEFAULT_MAX_MEMORY_SIZE);
+    m_statsFile = QFile::decodeName(qgetenv("QT_SHADER_CACHE_STATS"));
+    qCDebug(DBG_SHADER_CACHE, "Cache location '%s' writable = %d shared = %d pack = %d max size = %lld",
+            qPrintable(m_cacheDir), m_cacheWritable, m_shared, m_usePack, m_maxDiskSize);
+
+    // Pending writes must hit the disk before the application goes away. The
+    // destructor covers applications that never enter exec().
+    if (QCoreApplication *app = QCoreApplication::instance()) {
+        m_quitConnection = QObject::connect(app, &QCoreApplication::aboutToQuit, [this] {
+            flush();
+            dumpStats();
+        });
+    }
+}
+
+QOpenGLProgramBinaryCache::~QOpenGLProgramBinaryCache()
+{
+    // Instances other than the global one, as in the benchmarks, may go away
+    // before the application does.
+    QObject::disconnect(m_quitConnection);
+    dumpStats();
+    m_readerPool.waitForDone();
+    delete m_writer;
+    for (Namespace *ns : qAsConst(m_namespaces)) {
+        if (ns->policyDirty && m_cacheWritable)
+            writePolicy(ns);
+        delete ns->pack;
+        delete ns;
+    }
+}
+
+void QOpenGLProgramBinaryCacheStats::addTime(Timer t, qint64 nsecs)
+{
+    m_timeTotal[t].fetchAndAddRelaxed(nsecs);
+    m_timeCount[t].fetchAndAddRelaxed(1);
+    int bucket = 0;
+    for (qint64 us = nsecs / 1000; us > 0 && bucket < HistogramBuckets - 1; us >>= 1)
+        ++bucket;
+    m_histogram[t][bucket].fetchAndAddRelaxed(1);
+}
+
+void QOpenGLProgramBinaryCacheStats::reset()
+{
+    for (int c = 0; c < CounterCount; ++c)
+        m_counters[c].store(0);
+    for (int t = 0; t < TimerCount; ++t) {
+        m_timeTotal[t].store(0);
+        m_timeCount[t].store(0);
+        for (int b = 0; b < HistogramBuckets; ++b)
+            m_histogram[t][b].store(0);
+    }
+}
+
+// Bucket i of a histogram counts the durations below 2^i microseconds that did
+// not fit in the previous one; the last bucket is open-ended.
+QJsonObject QOpenGLProgramBinaryCacheStats::toJson() const
+{
+    static const char *counterNames[CounterCount] = {
+        "memoryHits", "diskHits", "misses", "driverRejects", "negativeHits", "slowHits", "policySkips", "corruptEntries",
+        "bytesRead", "bytesWritten"
+    };
+    static const char *timerNames[TimerCount] = {
+        "hash", "load", "programBinary", "compile", "link", "save"
+    };
+
+    QJsonObject result;
+    for (int c = 0; c < CounterCount; ++c)
+        result.insert(QLatin1String(counterNames[c]), double(m_counters[c].load()));
+    QJsonObject times;
+    for (int t = 0; t < TimerCount; ++t) {
+        QJsonObject timer;
+        timer.insert(QStringLiteral("count"), double(m_timeCount[t].load()));
+        timer.insert(QStringLiteral("totalUs"), double(m_timeTotal[t].load()) / 1000.0);
+        QJsonArray histogram;
+        for (int b = 0; b < HistogramBuckets; ++b)
+            histogram.append(double(m_histogram[t][b].load()));
+        timer.insert(QStringLiteral("histogramUs"), histogram);
+        times.insert(QLatin1String(timerNames[t]), timer);
+    }
+    result.insert(QStringLiteral("times"), times);
+    return result;
+}
+
+// Writes the statistics to the file named by QT_SHADER_CACHE_STATS, once.
+void QOpenGLProgramBinaryCache::dumpStats()
+{
+    if (m_statsFile.isEmpty() || !m_statsDumped.testAndSetRelaxed(0, 1))
+        return;
+    QFile f(m_statsFile);
+    if (f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        f.write(QJsonDocument(m_stats.toJson()).toJson());
+    else
+        qWarning("QOpenGLProgramBinaryCache: Cannot write statistics to %s", qPrintable(m_statsFile));
+}
+
+void QOpenGLProgramBinaryCache::flush()
+{
+    QList<Namespace *> namespaces;
+    QList<Namespace *> policies;
+    QList<Namespace *> stamps;
+    bool purge = false;
+    {
+        QMutexLocker locker(&m_namespaceLock);
+        if (m_maxDiskSize > 0 && m_cacheWritable)
+            namespaces = m_namespaces.values();
+        for (Namespace *ns : qAsConst(m_namespaces)) {
+            if (ns->policyDirty && m_cacheWritable)
+                policies.append(ns);
+            if (m_cacheWritable) {
+                ns->stamped.start();
+                stamps.append(ns);
+            }
+        }
+        // with nothing opened, nothing could be told apart as stale
+        purge = !m_shared && m_cacheWritable && !m_namespaces.isEmpty();
+    }
+    for (Namespace *ns : qAsConst(namespaces))
+        m_writer->enqueueEviction(ns);
+    for (Namespace *ns : qAsConst(policies))
+        m_writer->enqueuePolicy(ns);
+    for (Namespace *ns : qAsConst(stamps))
+        m_writer->enqueueStamp(ns);
+    if (purge && m_purgeStarted.testAndSetRelaxed(0, 1))
+        m_writer->enqueuePurge();
+    m_writer->flush();
+    QMutexLocker locker(&m_namespaceLock);
+    for (Namespace *ns : qAsConst(m_namespaces)) {
+        if (ns->pack)
+            ns->pack->flush();
+    }
+}
+
+void QOpenGLProgramBinaryCache::setMaxDiskSize(qint64 size)
+{
+    QMutexLocker locker(&m_namespaceLock);
+    m_maxDiskSize = qMax<qint64>(0, size);
+}
+
+qint64 QOpenGLProgramBinaryCache::maxDiskSize()
+{
+    QMutexLocker locker(&m_namespaceLock);
+    return m_maxDiskSize;
+}
+
+void QOpenGLProgramBinaryCache::setMaxMemorySize(qint64 size)
+{
+    size = qBound<qint64>(0, size, std::numeric_limits<int>::max());
+    {
+        QMutexLocker locker(&m_namespaceLock);
+        m_maxMemorySize = size;
+    }
+    for (MemCacheShard &shard : m_memCache) {
+        QMutexLocker locker(&shard.lock);
+        shard.cache.setMaxCost(int(size));
+    }
+    trimMemCache(size);
+}
+
+qint64 QOpenGLProgramBinaryCache::maxMemorySize()
+{
+    QMutexLocker locker(&m_namespaceLock);
+    return m_maxMemorySize;
+}
+
+// Whether load() and save() follow the measured cost of loads against builds.
+// Without it every program is cached, as in earlier versions.
+void QOpenGLProgramBinaryCache::setAdaptive(bool enable)
+{
+    QMutexLocker locker(&m_namespaceLock);
+    m_adaptive = enable;
+}
+
+bool QOpenGLProgramBinaryCache::isAdaptive()
+{
+    QMutexLocker locker(&m_namespaceLock);
+    return m_adaptive;
+}
+
+// Whether an entry found in this process stays on disk for the rest of it, so
+// that a program loaded from it may drop its sources: no disk budget evicts it,
+// and no other process shares the directory.
+bool QOpenGLProgramBinaryCache::keepsEntries()
+{
+    QMutexLocker locker(&m_namespaceLock);
+    return !m_shared && m_maxDiskSize <= 0;
+}
+
+qint64 QOpenGLProgramBinaryCache::memorySize()
+{
+    qint64 size = 0;
+    for (MemCacheShard &shard : m_memCache) {
+        QMutexLocker locker(&shard.lock);
+        size += shard.cache.totalCost();
+    }
+    return size;
+}
+
+QOpenGLProgramBinaryCache::MemCacheShard &QOpenGLProgramBinaryCache::memCacheShard(const QByteArray &cacheKey)
+{
+    return m_memCache[qHash(cacheKey) % MemCacheShardCount];
+}
+
+// The blob is returned with a reference to its storage or mapping, so the shard
+// is not locked while the driver consumes it and eviction cannot pull it away
+// meanwhile. warmedUp reports, once, that the entry was put there by warmUp()
+// and so has not been accounted for as used on disk yet.
+bool QOpenGLProgramBinaryCache::memCacheLookup(const QByteArray &fingerprint, const QByteArray &cacheKey,
+                                               MemCacheBlob *blob, bool *warmedUp)
+{
+    MemCacheShard &shard = memCacheShard(cacheKey);
+    QMutexLocker locker(&shard.lock);
+    MemCacheEntry *e = shard.cache.object(cacheKey);
+    if (!e || e->fingerprint != fingerprint)
+        return false;
+    *blob = e->blob;
+    if (warmedUp) {
+        *warmedUp = e->warmedUp;
+        e->warmedUp = false;
+    }
+    return true;
+}
+
+// Costed at the size of the binary, whether that is heap or a mapping of the
+// page cache, so the budget also bounds the address space held on to.
+void QOpenGLProgramBinaryCache::memCacheInsert(const QByteArray &fingerprint, const QByteArray &cacheKey,
+                                               const MemCacheBlob &blob, bool warmedUp)
+{
+    MemCacheEntry *e = new MemCacheEntry(fingerprint, blob, warmedUp);
+    {
+        MemCacheShard &shard = memCacheShard(cacheKey);
+        QMutexLocker locker(&shard.lock);
+        shard.cache.insert(cacheKey, e, blob.size);
+    }
+    trimMemCache(maxMemorySize());
+}
+
+// Each shard takes entries up to the whole budget, so that a binary larger
+// than a shard's share is still kept. The budget then holds for their sum:
+// the least recently used entries of the shards, taken in turn, are dropped
+// until it fits again. Shrinking and restoring the maximum cost is how QCache
+// is made to trim.
+void QOpenGLProgramBinaryCache::trimMemCache(qint64 budget)
+{
+    qint64 excess = memorySize() - budget;
+    for (int i = 0; excess > 0 && i < MemCacheShardCount; ++i) {
+        MemCacheShard &shard = m_memCache[uint(m_memCacheTrimShard.fetchAndAddRelaxed(1)) % MemCacheShardCount];
+        QMutexLocker locker(&shard.lock);
+        const int before = shard.cache.totalCost();
+        const int maxCost = shard.cache.maxCost();
+        shard.cache.setMaxCost(int(qMax<qint64>(0, before - excess)));
+        shard.cache.setMaxCost(maxCost);
+        excess -= before - shard.cache.totalCost();
+    }
+}
+
+// Runs on the writer thread. Per-file entries are ordered by modification
+// time, which load() refreshes (in bulk, here) for every entry it used. A
+// pack cannot drop records in place, so it is compacted instead.
+void QOpenGLProgramBinaryCache::evict(Namespace *ns)
+{
+    QSet<QByteArray> touched;
+    qint64 maxSize;
+    {
+        QMutexLocker locker(&m_namespaceLock);
+        touched.swap(ns->touched);
+        maxSize = m_maxDiskSize;
+    }
+    if (maxSize <= 0)
+        return;
+
+    if (ns->pack) {
+        ns->pack->evict(maxSize);
+        return;
+    }
+
+#ifdef Q_OS_UNIX
+    for (const QByteArray &cacheKey : qAsConst(touched))
+        ::utime(QFile::encodeName(cacheFileName(ns, cacheKey)).constData(), nullptr);
+#endif
+
+    // Metadata files have an extension, entries are bare keys.
+    const QFileInfoList entries = QDir(ns->dir).entryInfoList(QDir::Files, QDir::Time);
+    qint64 total = 0;
+    int removed = 0;
+    for (const QFileInfo &fi : entries) {
+        if (fi.fileName().contains(QLatin1Char('.')))
+            continue;
+        total += fi.size();
+        if (total > maxSize && QFile::remove(fi.filePath()))
+            ++removed;
+    }
+    qCDebug(DBG_SHADER_CACHE, "Evicted %d entries from %s, %lld bytes before", removed, qPrintable(ns->dir), total);
+}
+
+// Per namespace, rewritten by every process opening it, and again while it is
+// in use. Its modification time tells warmUp(), before there is a context to
+// compute a fingerprint from, which namespace was used last, and the purge of
+// a shared directory which ones are not used at all.
+static const char LAST_USED_FILE[] = "last.used";
+
+// Per namespace, the hex keys of the binaries the driver rejected, one per line.
+static const char REJECTED_FILE[] = "rejected.keys";
+
+// Per namespace, the adaptive policy's state: "hexkey strikes lastSlowRun" lines
+// for the programs that loaded no faster than they build, and the counters of
+// the whole namespace as "name value" lines.
+static const char SLOW_FILE[] = "slow.keys";
+static const char POLICY_FILE[] = "policy.stats";
+
+// Slow loads in a row after which a program is no longer cached, and runs in a
+// row with most loads slow after which the disk is not used for the driver.
+static const int POLICY_STRIKES = 3;
+// Timed disk hits a run needs before it counts for or against the namespace.
+static const int POLICY_MIN_RUN_SAMPLES = 8;
+// Runs after which a program or namespace is measured again, as the driver's
+// own cache or the storage may have changed since.
+static const int POLICY_RECHECK_RUNS = 20;
+
+static QSet<QByteArray> readKeyFile(const QString &fn)
+{
+    QSet<QByteArray> keys;
+    QFile f(fn);
+    if (f.open(QIODevice::ReadOnly)) {
+        while (!f.atEnd()) {
+            const QByteArray key = QByteArray::fromHex(f.readLine().trimmed());
+            if (!key.isEmpty())
+                keys.insert(key);
+        }
+    }
+    return keys;
+}
+
+// Also counts this run, and drops the decisions that are due for a recheck.
+void QOpenGLProgramBinaryCache::readPolicy(Namespace *ns)
+{
+    int runs = 0;
+    QFile policy(ns->dir + QLatin1String(POLICY_FILE));
+    if (policy.open(QIODevice::ReadOnly)) {
+        while (!policy.atEnd()) {
+            const QList<QByteArray> field = policy.readLine().simplified().split(' ');
+            if (field.count() != 2)
+                continue;
+            if (field[0] == "runs")
+                runs = qMax(0, field[1].toInt());
+            else if (field[0] == "slowRuns")
+                ns->slowRuns = qMax(0, field[1].toInt());
+            else if (field[0] == "disabledRun")
+                ns->disabledRun = qMax(0, field[1].toInt());
+        }
+    }
+    ns->run = runs + 1;
+    if (ns->disabledRun && ns->run - ns->disabledRun >= POLICY_RECHECK_RUNS) {
+        ns->disabledRun = 0;
+        ns->slowRuns = 0;
+    }
+    ns->diskDisabled = ns->disabledRun != 0;
+
+    QFile slow(ns->dir + QLatin1String(SLOW_FILE));
+    if (!slow.open(QIODevice::ReadOnly))
+        return;
+    while (!slow.atEnd()) {
+        const QList<QByteArray> field = slow.readLine().simplified().split(' ');
+        if (field.count() != 3)
+            continue;
+        const QByteArray key = QByteArray::fromHex(field[0]);
+        const SlowKey k = { qMax(0, field[1].toInt()), qMax(0, field[2].toInt()) };
+        if (key.isEmpty() || ns->run - k.lastSlowRun >= POLICY_RECHECK_RUNS)
+            continue;
+        ns->slowKeys.insert(key, k);
+        if (k.strikes >= POLICY_STRIKES)
+            ns->slow.insert(key);
+    }
+}
+
+// Runs on the writer thread.
+void QOpenGLProgramBinaryCache::stampNamespace(Namespace *ns)
+{
+    QFile f(ns->dir + QLatin1String(LAST_USED_FILE));
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate) || f.write(QByteArray::number(QDateTime::currentMSecsSinceEpoch())) <= 0)
+        qCDebug(DBG_SHADER_CACHE, "Failed to stamp %s", qPrintable(f.fileName()));
+}
+
+// Namespace directories are named after a SHA-1 fingerprint, and entries of
+// the layout before namespaces after a SHA-1 key. Nothing else in the cache
+// directory, which may be a shared or user-chosen one, is touched.
+static bool isCacheFileName(const QString &name)
+{
+    if (name.size() != 40)
+        return false;
+    for (QChar c : name) {
+        if (!((c >= QLatin1Char('0') && c <= QLatin1Char('9')) || (c >= QLatin1Char('a') && c <= QLatin1Char('f'))))
+            return false;
+    }
+    return true;
+}
+
+// When the namespace was last opened, or for the entries of the layout before
+// namespaces, written.
+static QDateTime lastUsed(const QFileInfo &fi)
+{
+    const QFileInfo stamp(fi.filePath() + QLatin1Char('/') + QLatin1String(LAST_USED_FILE));
+    return fi.isDir() && stamp.exists() ? stamp.lastModified() : fi.lastModified();
+}
+
+// In a shared directory, namespaces not opened for this long are assumed to
+// belong to a driver or cache version that is gone. Other processes may be
+// using a different driver at the same time, so only age tells the stale ones
+// apart there. Namespaces in use are stamped again at least this often.
+static const int STALE_NAMESPACE_AGE_DAYS = 7;
+static const qint64 RESTAMP_INTERVAL_MSECS = 24 * 60 * 60 * 1000;
+
+// Appended to what the purge is about to remove, which is picked up again
+// by a later one if the process goes away in the middle of it.
+static const char PURGED_SUFFIX[] = ".purged";
+
+// Runs on the writer thread, once per process. Removes the namespaces of other
+// drivers and the entries of older cache versions in one go, instead of
+// leaving them to pile up after updates. A private directory is only used by
+// this process, so that is everything it has not opened; a shared one keeps
+// what other processes used within the last week.
+void QOpenGLProgramBinaryCache::purgeStale()
+{
+    const QDateTime cutoff = QDateTime::currentDateTime().addDays(-STALE_NAMESPACE_AGE_DAYS);
+
+    int removed = 0;
+    const QFileInfoList entries = QDir(m_cacheDir).entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot);
+    for (const QFileInfo &fi : entries) {
+        const QString name = fi.fileName();
+        QString path = fi.filePath();
+        const bool leftOver = name.endsWith(QLatin1String(PURGED_SUFFIX)) && isCacheFileName(name.left(40));
+        if (!leftOver) {
+            if (!isCacheFileName(name) || (m_shared && lastUsed(fi) > cutoff))
+                continue;
+            // Moved out of the way with no namespace being opened meanwhile,
+            // so that one opened since the purge started is not removed.
+            QMutexLocker locker(&m_namespaceLock);
+            if (m_namespaces.contains(name.toLatin1()) || !QDir().rename(path, path + QLatin1String(PURGED_SUFFIX)))
+                continue;
+            path += QLatin1String(PURGED_SUFFIX);
+        }
+        if (fi.isDir() ? QDir(path).removeRecursively() : QFile::remove(path))
+            ++removed;
+    }
+    qCDebug(DBG_SHADER_CACHE, "Purged %d stale namespaces and entries from %s", removed, qPrintable(m_cacheDir));
+}
+
+QOpenGLProgramBinaryCache::Namespace *QOpenGLProgramBinaryCache::cacheNamespace(const QByteArray &fingerprint)
+{
+    QMutexLocker locker(&m_namespaceLock);
+    Namespace *ns = m_namespaces.value(fingerprint);
+    if (ns) {
+        // so that the purge of a shared directory does not take it for unused
+        if (m_cacheWritable && ns->stamped.hasExpired(RESTAMP_INTERVAL_MSECS)) {
+            ns->stamped.start();
+            locker.unlock();
+            m_writer->enqueueStamp(ns);
+        }
+        return ns;
+    }
+
+    ns = new Namespace;
+    ns->dir = m_cacheDir + QString::fromLatin1(fingerprint) + QLatin1Char('/');
+    if (m_cacheWritable)
+        QDir::root().mkpath(ns->dir);
+    ns->rejected = readKeyFile(ns->dir + QLatin1String(REJECTED_FILE));
+    if (!ns->rejected.isEmpty())
+        qCDebug(DBG_SHADER_CACHE, "%d programs known to be rejected by the driver", ns->rejected.count());
+    readPolicy(ns);
+    // the run count and the rechecks are to be stored even without a hit
+    ns->policyDirty = true;
+    qCDebug(DBG_SHADER_CACHE, "%d programs known to load slower than they build, disk %s",
+            ns->slow.count(), ns->diskDisabled ? "disabled" : "enabled");
+    // Entries of the programs found slow in the last run, still needed then
+    // for relinking, are removed once.
+    QVector<QByteArray> stale;
+    for (auto it = ns->slowKeys.cbegin(), end = ns->slowKeys.cend(); it != end; ++it) {
+        if (it->strikes >= POLICY_STRIKES && it->lastSlowRun == ns->run - 1)
+            stale.append(it.key());
+    }
+    ns->pack = m_usePack ? new QOpenGLProgramBinaryPack(ns->dir, m_shared) : nullptr;
+    ns->stamped.start();
+    m_namespaces.insert(fingerprint, ns);
+    const bool trim = !ns->pack && m_maxDiskSize > 0 && m_cacheWritable;
+    locker.unlock();
+
+    // A private directory is purged in flush() instead, once the contexts of
+    // all versions this process uses had the chance to open their namespace.
+    if (m_cacheWritable) {
+        m_writer->enqueueStamp(ns);
+        for (const QByteArray &cacheKey : qAsConst(stale))
+            m_writer->enqueueRemoval(ns, cacheKey);
+        if (m_shared && m_purgeStarted.testAndSetRelaxed(0, 1))
+            m_writer->enqueuePurge();
+    }
+
+    // Trim what previous runs left behind. Packs are only compacted in
+    // flush(), since that invalidates pointers into the current mapping.
+    if (trim)
+        m_writer->enqueueEviction(ns);
+    return ns;
+}
+
+// Keys are binary, hex only where they become file names.
+QString QOpenGLProgramBinaryCache::cacheFileName(const Namespace *ns, const QByteArray &cacheKey) const
+{
+    return ns->dir + QString::fromLatin1(cacheKey.toHex());
+}
+
+// Source digests, memoized by data identity: programs sharing a source (one
+// QByteArray, or one string via internSource()) hash its bytes only once. The
+// entries hold a shallow copy, so the data cannot be freed and reused while
+// they exist, and are pruned once nothing else refers to that data anymore.
+// Raw data is never memoized, since its lifetime is not the memo's to extend.
+class QOpenGLShaderDigestMemo
+{
+public:
+    void digest(const QByteArray &source, uchar *result);
+    QByteArray intern(const char *source);
+
+private:
+    typedef QPair<const char *, int> SourceId;
+    struct Entry {
+        QByteArray source;
+        uchar digest[QOpenGLShaderHash::Size];
+    };
+    void insert(const Entry &e);
+
+    QMutex m_lock;
+    QHash<SourceId, Entry> m_digests;
+    // Keyed by the caller's string, refers to a copy in m_digests.
+    QHash<const char *, SourceId> m_interned;
+    int m_pruneAt = 64;
+};
+
+Q_GLOBAL_STATIC(QOpenGLShaderDigestMemo, qt_gl_shader_digest_memo)
+
+void QOpenGLShaderDigestMemo::insert(const Entry &e)
+{
+    if (m_digests.count() >= m_pruneAt) {
+        for (auto it = m_digests.begin(); it != m_digests.end(); ) {
+            if (it->source.isDetached())
+                it = m_digests.erase(it);
+            else
+                ++it;
+        }
+        for (auto it = m_interned.begin(); it != m_interned.end(); ) {
+            if (!m_digests.contains(it.value()))
+                it = m_interned.erase(it);
+            else
+                ++it;
+        }
+        m_pruneAt = qMax(64, m_digests.count() * 2);
+    }
+    m_digests.insert(SourceId(e.source.constData(), e.source.size()), e);
+}
+
+void QOpenGLShaderDigestMemo::digest(const QByteArray &source, uchar *result)
+{
+    // Raw data is not owned by the array: the caller may free it and put
+    // different text at the same address, so its identity says nothing.
+    if (source.capacity() < source.size()) {
+        QOpenGLShaderHash::hash(source.constData(), source.size(), 0, result);
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_lock);
+        auto it = m_digests.constFind(SourceId(source.constData(), source.size()));
+        if (it != m_digests.constEnd()) {
+            memcpy(result, it->digest, QOpenGLShaderHash::Size);
+            return;
+        }
+    }
+
+    Entry e;
+    e.source = source;
+    QOpenGLShaderHash::hash(source.constData(), source.size(), 0, e.digest);
+    memcpy(result, e.digest, QOpenGLShaderHash::Size);
+    QMutexLocker locker(&m_lock);
+    insert(e);
 }
 
-QString QOpenGLProgramBinaryCache::cacheFileName(const QByteArray &cacheKey) const
+// A const char * source is usually a string literal passed for every program
+// using it. Returns the QByteArray made for an earlier call with the same
+// pointer, when the contents still match, so that its digest is memoized and
+// the programs share one copy.
+QByteArray QOpenGLShaderDigestMemo::intern(const char *source)
 {
-    return m_cacheDir + QString::fromUtf8(cacheKey);
+    const int len = int(qstrlen(source));
+    QMutexLocker locker(&m_lock);
+    auto it = m_digests.constFind(m_interned.value(source));
+    if (it != m_digests.constEnd() && it->source.size() == len && memcmp(it->source.constData(), source, len) == 0)
+        return it->source;
+
+    Entry e;
+    e.source = QByteArray(source, len);
+    QOpenGLShaderHash::hash(e.source.constData(), len, 0, e.digest);
+    insert(e);
+    m_interned.insert(source, SourceId(e.source.constData(), len));
+    return e.source;
+}
+
+QByteArray QOpenGLProgramBinaryCache::internSource(const char *source)
+{
+    return qt_gl_shader_digest_memo()->intern(source);
+}
+
+// Each source is hashed on its own, then the stage types and source digests
+// are hashed together, so that the same sources in different stages give
+// different keys.
+// Marks a shader whose type and source digest are followed by a digest of its defines.
+static const quint32 KEY_VARIANT_FLAG = 0x80000000;
+
+QByteArray QOpenGLProgramBinaryCache::cacheKey(const ProgramDesc &program)
+{
+    const int stride = sizeof(quint32) + QOpenGLShaderHash::Size;
+    int size = 0;
+    for (const ShaderDesc &shader : program.shaders)
+        size += stride + (shader.defines.isEmpty() ? 0 : int(QOpenGLShaderHash::Size));
+    QVarLengthArray<uchar, 4 * stride> buf(size);
+    uchar *p = buf.data();
+    QOpenGLShaderDigestMemo *memo = qt_gl_shader_digest_memo();
+    for (const ShaderDesc &shader : program.shaders) {
+        qToLittleEndian<quint32>(uint(shader.type) | (shader.defines.isEmpty() ? 0 : KEY_VARIANT_FLAG), p);
+        memo->digest(shader.source, p + sizeof(quint32));
+        p += stride;
+        if (!shader.defines.isEmpty()) {
+            const QByteArray defines = shader.defines.join('\n');
+            QOpenGLShaderHash::hash(defines.constData(), defines.size(), BINSHADER_KEYVERSION, p);
+            p += QOpenGLShaderHash::Size;
+        }
+    }
+    QByteArray key(QOpenGLShaderHash::Size, Qt::Uninitialized);
+    QOpenGLShaderHash::hash(buf.constData(), buf.size(), BINSHADER_KEYVERSION, reinterpret_cast<uchar *>(key.data()));
+    return key;
 }
 
 static const int HEADER_SIZE = 3 * sizeof(quint32);
@@ -114,7 +1037,7 @@ bool QOpenGLProgramBinaryCache::verifyHeader(const QByteArray &buf) const
         qCDebug(DBG_SHADER_CACHE, "Magic does not match");
         return false;
     }
-    if (*p++ != BINSHADER_VERSION) {
+    if ((*p++ & ~BINSHADER_FLAGS_MASK) != BINSHADER_VERSION) {
         qCDebug(DBG_SHADER_CACHE, "Version does not match");
         return false;
     }
@@ -125,43 +1048,111 @@ bool QOpenGLProgramBinaryCache::verifyHeader(const QByteArray &buf) const
     return true;
 }
 
-bool QOpenGLProgramBinaryCache::setProgramBinary(uint programId, uint blobFormat, const void *p, uint blobSize)
+// A rejected binary leaves the program unlinked, which is all the caller needs
+// to know; the base class then only picks up the status instead of linking.
+bool QOpenGLProgramBinarySupportCheck::programBinary(uint programId, uint binaryFormat,
+                                                     const void *binary, uint length) const
 {
-    QOpenGLExtraFunctions *funcs = QOpenGLContext::currentContext()->extraFunctions();
+    QOpenGLContext *ctx = QOpenGLContext::currentContext();
+    QOpenGLFunctions *funcs = ctx->functions();
     funcs->glGetError();
-    funcs->glProgramBinary(programId, blobFormat, p, blobSize);
-    int err = funcs->glGetError();
-    qCDebug(DBG_SHADER_CACHE, "Program binary set for program %u, size %d, format 0x%x, err = 0x%x",
-            programId, blobSize, blobFormat, err);
-    return err == 0;
+    if (m_programBinaryOES)
+        m_programBinaryOES(programId, binaryFormat, binary, GLint(length));
+    else
+        ctx->extraFunctions()->glProgramBinary(programId, binaryFormat, binary, GLsizei(length));
+    const int err = funcs->glGetError();
+    GLint linked = 0;
+    if (!err)
+        funcs->glGetProgramiv(programId, GL_LINK_STATUS, &linked);
+    qCDebug(DBG_SHADER_CACHE, "Program binary set for program %u, size %u, format 0x%x, err = 0x%x, linked = %d",
+            programId, length, binaryFormat, err, linked);
+    return linked;
+}
+
+uint QOpenGLProgramBinarySupportCheck::programBinaryLength(uint programId) const
+{
+    QOpenGLFunctions *funcs = QOpenGLContext::currentContext()->functions();
+    GLint length = 0;
+    funcs->glGetError();
+    // Same value as GL_PROGRAM_BINARY_LENGTH_OES.
+    funcs->glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    qCDebug(DBG_SHADER_CACHE, "Program binary is %d bytes, err = 0x%x", length, funcs->glGetError());
+    return uint(qMax(0, length));
+}
+
+uint QOpenGLProgramBinarySupportCheck::getProgramBinary(uint programId, uint bufSize, uint *binaryFormat, void *binary) const
+{
+    GLsizei length = 0;
+    GLenum format = 0;
+    if (m_getProgramBinaryOES)
+        m_getProgramBinaryOES(programId, GLsizei(bufSize), &length, &format, binary);
+    else
+        QOpenGLContext::currentContext()->extraFunctions()->glGetProgramBinary(programId, GLsizei(bufSize), &length, &format, binary);
+    *binaryFormat = format;
+    return uint(qMax(0, length));
+}
+
+// Tells drivers that do extra work to keep a program retrievable to do so,
+// before the link of a program that is going to be saved. ES 2.0 has no hint.
+void QOpenGLProgramBinarySupportCheck::setRetrievableHint(GLuint program) const
+{
+    if (!m_programBinaryOES)
+        QOpenGLContext::currentContext()->extraFunctions()->glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+bool QOpenGLProgramBinaryCache::setProgramBinary(const QOpenGLProgramBinaryBackend *support, uint programId,
+                                                 uint blobFormat, const void *p, uint blobSize)
+{
+    QOpenGLProgramBinaryCacheStats::Timing timing(&m_stats, QOpenGLProgramBinaryCacheStats::ProgramBinaryTime);
+    const bool linked = support->programBinary(programId, blobFormat, p, blobSize);
+    if (!linked)
+        m_stats.add(QOpenGLProgramBinaryCacheStats::DriverRejects);
+    return linked;
 }
 
 #ifdef Q_OS_UNIX
+// A whole entry file mapped read-only, unmapped when the last load or memory
+// cache entry using it lets go. Files are only ever replaced by a rename, never
+// rewritten in place, so the contents stay intact for as long as it exists.
+class QOpenGLProgramBinaryMapping
+{
+public:
+    QOpenGLProgramBinaryMapping(void *ptr, size_t size)
+        : ptr(ptr),
+          size(size)
+    {
+    }
+    ~QOpenGLProgramBinaryMapping()
+    {
+        munmap(ptr, size);
+    }
+
+    void *ptr;
+    size_t size;
+};
+
 class FdWrapper
 {
 public:
     FdWrapper(const QString &fn)
-        : ptr(MAP_FAILED)
     {
         fd = qt_safe_open(QFile::encodeName(fn).constData(), O_RDONLY);
     }
     ~FdWrapper()
     {
-        if (ptr != MAP_FAILED)
-            munmap(ptr, mapSize);
         if (fd != -1)
             qt_safe_close(fd);
     }
-    bool map()
+    QSharedPointer<QOpenGLProgramBinaryMapping> map()
     {
-        mapSize = static_cast<size_t>(lseek(fd, 0, SEEK_END));
-        ptr = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
-        return ptr != MAP_FAILED;
+        const size_t mapSize = static_cast<size_t>(lseek(fd, 0, SEEK_END));
+        void *ptr = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED)
+            return QSharedPointer<QOpenGLProgramBinaryMapping>();
+        return QSharedPointer<QOpenGLProgramBinaryMapping>(new QOpenGLProgramBinaryMapping(ptr, mapSize));
     }
 
     int fd;
-    void *ptr;
-    size_t mapSize;
 };
 #endif
 
@@ -187,100 +1178,661 @@ public:
     bool active;
 };
 
-bool QOpenGLProgramBinaryCache::load(const QByteArray &cacheKey, uint programId)
+// Entry layout: header, binary format, binary size, time it took to compile
+// and link the program in microseconds (0 if unknown), binary. The driver
+// strings are not stored; the namespace directory already guarantees they match.
+static const int ENTRY_HEADER_SIZE = HEADER_SIZE + 3 * sizeof(quint32);
+
+// Compressed entries have the uncompressed size after the stored one.
+static const int LZ4_ENTRY_HEADER_SIZE = ENTRY_HEADER_SIZE + sizeof(quint32);
+
+// Compression must save at least this fraction of the binary to be used;
+// below that reading the few extra bytes is cheaper than decompressing.
+static const int MIN_COMPRESSION_GAIN_DIVISOR = 8;
+
+// Validates a complete cache entry (as stored in a file or a pack record) and
+// returns a pointer to the program binary in it, or null if it must not be used.
+// Compressed binaries are decompressed into buffer.
+const uchar *QOpenGLProgramBinaryCache::parseEntry(const uchar *data, qint64 size,
+                                                   quint32 *blobFormat, quint32 *blobSize,
+                                                   QByteArray *buffer, quint32 *buildUsecs) const
+{
+    const int headerSize = int(qMin<qint64>(size, HEADER_SIZE));
+    if (!verifyHeader(QByteArray::fromRawData(reinterpret_cast<const char *>(data), headerSize)))
+        return nullptr;
+
+    const bool compressed = reinterpret_cast<const quint32 *>(data)[1] & BINSHADER_FLAG_LZ4;
+    const int entryHeaderSize = compressed ? LZ4_ENTRY_HEADER_SIZE : ENTRY_HEADER_SIZE;
+    if (size < entryHeaderSize) {
+        qCDebug(DBG_SHADER_CACHE, "Cached entry truncated");
+        return nullptr;
+    }
+    const quint32 *p = reinterpret_cast<const quint32 *>(data + HEADER_SIZE);
+    *blobFormat = *p++;
+    *blobSize = *p++;
+    const quint32 build = *p++;
+    if (buildUsecs)
+        *buildUsecs = build;
+    if (size - entryHeaderSize < qint64(*blobSize)) {
+        qCDebug(DBG_SHADER_CACHE, "Cached entry truncated");
+        return nullptr;
+    }
+    if (!compressed)
+        return data + entryHeaderSize;
+
+    const quint32 rawSize = *p++;
+    if (rawSize > quint32(std::numeric_limits<int>::max())) {
+        qCDebug(DBG_SHADER_CACHE, "Cached entry corrupt");
+        return nullptr;
+    }
+    buffer->resize(int(rawSize));
+    if (!QOpenGLLz4::decompress(data + entryHeaderSize, int(*blobSize),
+                                reinterpret_cast<uchar *>(buffer->data()), int(rawSize))) {
+        qCDebug(DBG_SHADER_CACHE, "Cached entry fails to decompress");
+        return nullptr;
+    }
+    *blobSize = rawSize;
+    return reinterpret_cast<const uchar *>(buffer->constData());
+}
+
+// Rewrites an entry with a compressed binary, if that makes it sufficiently
+// smaller. Runs on the writer thread.
+QByteArray QOpenGLProgramBinaryCache::compressEntry(const QByteArray &entry) const
+{
+    const int rawSize = entry.size() - ENTRY_HEADER_SIZE;
+    const int maxSize = rawSize - rawSize / MIN_COMPRESSION_GAIN_DIVISOR;
+    QByteArray result(LZ4_ENTRY_HEADER_SIZE + QOpenGLLz4::compressBound(rawSize), Qt::Uninitialized);
+    const int size = QOpenGLLz4::compress(reinterpret_cast<const uchar *>(entry.constData()) + ENTRY_HEADER_SIZE, rawSize,
+                                          reinterpret_cast<uchar *>(result.data()) + LZ4_ENTRY_HEADER_SIZE, maxSize);
+    if (!size)
+        return entry;
+
+    const quint32 *src = reinterpret_cast<const quint32 *>(entry.constData());
+    quint32 *p = reinterpret_cast<quint32 *>(result.data());
+    *p++ = src[0];
+    *p++ = src[1] | BINSHADER_FLAG_LZ4;
+    *p++ = src[2];
+    *p++ = src[3];
+    *p++ = quint32(size);
+    *p++ = src[5];
+    *p++ = quint32(rawSize);
+    result.resize(LZ4_ENTRY_HEADER_SIZE + size);
+    qCDebug(DBG_SHADER_CACHE, "Compressed program binary from %d to %d bytes", rawSize, size);
+    return result;
+}
+
+// Turns a compressed entry back into a plain one, so that the prefetching
+// thread does the decompression rather than load().
+QByteArray QOpenGLProgramBinaryCache::decompressEntry(const QByteArray &entry) const
+{
+    if (entry.size() < HEADER_SIZE
+            || !(reinterpret_cast<const quint32 *>(entry.constData())[1] & BINSHADER_FLAG_LZ4))
+        return entry;
+    quint32 blobFormat = 0;
+    quint32 blobSize = 0;
+    quint32 buildUsecs = 0;
+    QByteArray buffer;
+    const uchar *blob = parseEntry(reinterpret_cast<const uchar *>(entry.constData()), entry.size(),
+                                   &blobFormat, &blobSize, &buffer, &buildUsecs);
+    if (!blob)
+        return entry;
+    QByteArray result(ENTRY_HEADER_SIZE + int(blobSize), Qt::Uninitialized);
+    quint32 *p = reinterpret_cast<quint32 *>(result.data());
+    *p++ = BINSHADER_MAGIC;
+    *p++ = BINSHADER_VERSION;
+    *p++ = BINSHADER_QTVERSION;
+    *p++ = blobFormat;
+    *p++ = blobSize;
+    *p++ = buildUsecs;
+    memcpy(p, blob, blobSize);
+    return result;
+}
+
+bool QOpenGLProgramBinaryCache::useFileEntry(const QOpenGLProgramBinaryBackend *support, Namespace *ns,
+                                             const QByteArray &cacheKey, uint programId, const MemCacheBlob &blob,
+                                             quint32 buildUsecs, const QElapsedTimer &elapsed)
+{
+    const bool ok = setProgramBinary(support, programId, blob.format, blob.data, blob.size);
+    if (ok) {
+        m_stats.add(QOpenGLProgramBinaryCacheStats::DiskHits);
+        memCacheInsert(support->fingerprint(), cacheKey, blob);
+        recordDiskHit(ns, cacheKey, buildUsecs, elapsed.nsecsElapsed());
+        QMutexLocker locker(&m_namespaceLock);
+        ns->touched.insert(cacheKey);
+    } else {
+        reject(ns, cacheKey);
+    }
+    return ok;
+}
+
+bool QOpenGLProgramBinaryCache::isRejected(Namespace *ns, const QByteArray &cacheKey)
+{
+    QMutexLocker locker(&m_namespaceLock);
+    return ns->rejected.contains(cacheKey);
+}
+
+// The driver did not take a binary it produced itself. Loading it again would
+// only add to the compile that follows, in this run and the next ones.
+void QOpenGLProgramBinaryCache::reject(Namespace *ns, const QByteArray &cacheKey)
+{
+    {
+        QMutexLocker locker(&m_namespaceLock);
+        ns->rejected.insert(cacheKey);
+    }
+    qCDebug(DBG_SHADER_CACHE, "Program binary %s rejected, not using the cache for it any more",
+            cacheKey.toHex().constData());
+    if (m_cacheWritable)
+        m_writer->enqueueRejection(ns, cacheKey);
+}
+
+// Appends are small enough to not interleave with those of other processes
+// sharing the directory.
+static void appendKey(const QString &fn, const QByteArray &cacheKey)
+{
+    QFile f(fn);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Append) || f.write(cacheKey.toHex() + '\n') <= 0)
+        qCDebug(DBG_SHADER_CACHE, "Failed to record program in %s", qPrintable(fn));
+}
+
+// Runs on the writer thread.
+void QOpenGLProgramBinaryCache::removeEntry(Namespace *ns, const QByteArray &cacheKey)
+{
+    if (ns->pack)
+        ns->pack->remove(cacheKey);
+    else
+        QFile::remove(cacheFileName(ns, cacheKey));
+}
+
+// Runs on the writer thread.
+void QOpenGLProgramBinaryCache::writeRejection(Namespace *ns, const QByteArray &cacheKey)
+{
+    removeEntry(ns, cacheKey);
+    appendKey(ns->dir + QLatin1String(REJECTED_FILE), cacheKey);
+}
+
+// Whether the adaptive policy found, in earlier runs, that the cache does not
+// pay off for the program: it, or most programs of this driver, loaded from
+// disk no faster than they compiled and linked, several times in a row.
+// Drivers with a shader cache of their own get there, as do tiny programs.
+// Decisions only take effect in the next run, so that programs whose sources
+// were released after a load in this one can still be relinked from the
+// cache, and are dropped again after POLICY_RECHECK_RUNS runs.
+bool QOpenGLProgramBinaryCache::skipsCache(Namespace *ns, const QByteArray &cacheKey)
+{
+    QMutexLocker locker(&m_namespaceLock);
+    return m_adaptive && (ns->diskDisabled || ns->slow.contains(cacheKey));
+}
+
+// Compares the time it took to read an entry and hand it to the driver against
+// the build time the entry was saved with. A fast load clears the strikes of
+// the program, so that one cold read does not get it dropped.
+void QOpenGLProgramBinaryCache::recordDiskHit(Namespace *ns, const QByteArray &cacheKey, quint32 buildUsecs,
+                                              qint64 nsecs)
+{
+    if (!buildUsecs)
+        return;
+    const bool slow = nsecs >= qint64(buildUsecs) * 1000;
+    bool marked = false;
+    {
+        QMutexLocker locker(&m_namespaceLock);
+        if (!m_adaptive)
+            return;
+        ++ns->runHits;
+        if (slow) {
+            ++ns->runSlowHits;
+            SlowKey &k = ns->slowKeys[cacheKey];
+            k.lastSlowRun = ns->run;
+            marked = ++k.strikes == POLICY_STRIKES;
+        } else {
+            ns->slowKeys.remove(cacheKey);
+        }
+        ns->policyDirty = true;
+    }
+    if (!slow)
+        return;
+    m_stats.add(QOpenGLProgramBinaryCacheStats::SlowHits);
+    qCDebug(DBG_SHADER_CACHE, "Program binary %s took %lld us to load, %u us to build%s",
+            cacheKey.toHex().constData(), nsecs / 1000, buildUsecs,
+            marked ? ", not caching it from the next run on" : "");
+}
+
+// Runs on the writer thread, or in the destructor once that is gone. A run
+// with three quarters of its timed hits slow counts against the namespace,
+// and POLICY_STRIKES such runs in a row turn the disk off for the driver. In
+// a shared directory the process writing last wins.
+void QOpenGLProgramBinaryCache::writePolicy(Namespace *ns)
+{
+    int run;
+    int slowRuns;
+    int disabledRun;
+    QHash<QByteArray, SlowKey> slowKeys;
+    {
+        QMutexLocker locker(&m_namespaceLock);
+        // flush() may come more than once per run, the first one with enough
+        // hits gives the verdict
+        if (ns->runHits >= POLICY_MIN_RUN_SAMPLES) {
+            ns->slowRuns = ns->runSlowHits * 4 >= ns->runHits * 3 ? ns->slowRuns + 1 : 0;
+            ns->runHits = ns->runSlowHits = 0;
+        }
+        if (!ns->disabledRun && ns->slowRuns >= POLICY_STRIKES) {
+            ns->disabledRun = ns->run;
+            qCDebug(DBG_SHADER_CACHE, "Programs loaded slower than they build in %d runs, disabling %s",
+                    ns->slowRuns, qPrintable(ns->dir));
+        }
+        run = ns->run;
+        slowRuns = ns->slowRuns;
+        disabledRun = ns->disabledRun;
+        slowKeys = ns->slowKeys;
+        ns->policyDirty = false;
+    }
+
+    QSaveFile f(ns->dir + QLatin1String(POLICY_FILE));
+    if (f.open(QIODevice::WriteOnly)) {
+        f.write("runs " + QByteArray::number(run) + "\nslowRuns " + QByteArray::number(slowRuns)
+                + "\ndisabledRun " + QByteArray::number(disabledRun) + '\n');
+        f.commit();
+    }
+
+    QByteArray lines;
+    for (auto it = slowKeys.cbegin(), end = slowKeys.cend(); it != end; ++it) {
+        lines += it.key().toHex() + ' ' + QByteArray::number(it->strikes) + ' '
+                 + QByteArray::number(it->lastSlowRun) + '\n';
+    }
+    QSaveFile slow(ns->dir + QLatin1String(SLOW_FILE));
+    if (slow.open(QIODevice::WriteOnly)) {
+        slow.write(lines);
+        slow.commit();
+    }
+}
+
+bool QOpenGLProgramBinaryCache::load(const QOpenGLProgramBinaryBackend *support, const QByteArray &cacheKey, uint programId)
 {
-    if (m_memCache.contains(cacheKey)) {
-        const MemCacheEntry *e = m_memCache[cacheKey];
-        return setProgramBinary(programId, e->format, e->blob.constData(), e->blob.count());
+    QOpenGLProgramBinaryCacheStats::Timing timing(&m_stats, QOpenGLProgramBinaryCacheStats::LoadTime);
+    const QByteArray fingerprint = support->fingerprint();
+    Namespace *ns = cacheNamespace(fingerprint);
+    if (isRejected(ns, cacheKey)) {
+        m_stats.add(QOpenGLProgramBinaryCacheStats::NegativeHits);
+        return false;
+    }
+
+    MemCacheBlob memBlob;
+    bool warmedUp = false;
+    if (memCacheLookup(fingerprint, cacheKey, &memBlob, &warmedUp)) {
+        if (warmedUp) {
+            QMutexLocker locker(&m_namespaceLock);
+            ns->touched.insert(cacheKey);
+        }
+        const bool ok = setProgramBinary(support, programId, memBlob.format, memBlob.data, memBlob.size);
+        if (ok)
+            m_stats.add(QOpenGLProgramBinaryCacheStats::MemoryHits);
+        else
+            reject(ns, cacheKey);
+        return ok;
+    }
+
+    if (skipsCache(ns, cacheKey)) {
+        m_stats.add(QOpenGLProgramBinaryCacheStats::PolicySkips);
+        return false;
+    }
+
+    quint32 blobFormat = 0;
+    quint32 blobSize = 0;
+    quint32 buildUsecs = 0;
+    const uchar *blob;
+    QByteArray buffer;
+    // Times what the policy weighs against a build: reading the entry and
+    // handing it to the driver, not opening the namespace or waiting for a
+    // reader thread.
+    QElapsedTimer elapsed;
+
+    if (ns->pack) {
+        const uchar *data;
+        quint32 size;
+        elapsed.start();
+        if (!ns->pack->find(cacheKey, &data, &size)) {
+            m_stats.add(QOpenGLProgramBinaryCacheStats::Misses);
+            return false;
+        }
+        m_stats.add(QOpenGLProgramBinaryCacheStats::BytesRead, size);
+        blob = parseEntry(data, size, &blobFormat, &blobSize, &buffer, &buildUsecs);
+        if (!blob) {
+            m_stats.add(QOpenGLProgramBinaryCacheStats::CorruptEntries);
+            ns->pack->remove(cacheKey);
+            return false;
+        }
+        const bool ok = setProgramBinary(support, programId, blobFormat, blob, blobSize);
+        if (ok) {
+            m_stats.add(QOpenGLProgramBinaryCacheStats::DiskHits);
+            memCacheInsert(fingerprint, cacheKey, MemCacheBlob(blob, blobSize, blobFormat, buffer));
+            recordDiskHit(ns, cacheKey, buildUsecs, elapsed.nsecsElapsed());
+        } else {
+            reject(ns, cacheKey);
+        }
+        return ok;
     }
 
-    QByteArray buf;
-    const QString fn = cacheFileName(cacheKey);
+    const QString fn = cacheFileName(ns, cacheKey);
     DeferredFileRemove undertaker(fn);
+
+    QByteArray prefetched;
+    const PrefetchResult prefetchResult = takePrefetched(ns, cacheKey, &prefetched);
+    elapsed.start();
+    switch (prefetchResult) {
+    case PrefetchMissing:
+        m_stats.add(QOpenGLProgramBinaryCacheStats::Misses);
+        return false;
+    case PrefetchDone:
+        blob = parseEntry(reinterpret_cast<const uchar *>(prefetched.constData()), prefetched.size(),
+                          &blobFormat, &blobSize, &buffer, &buildUsecs);
+        if (!blob) {
+            m_stats.add(QOpenGLProgramBinaryCacheStats::CorruptEntries);
+            undertaker.setActive();
+            return false;
+        }
+        return useFileEntry(support, ns, cacheKey, programId,
+                            MemCacheBlob(blob, blobSize, blobFormat, buffer.isEmpty() ? prefetched : buffer),
+                            buildUsecs, elapsed);
+    case NotPrefetched:
+        break;
+    }
+
 #ifdef Q_OS_UNIX
     FdWrapper fdw(fn);
-    if (fdw.fd == -1)
+    if (fdw.fd == -1) {
+        m_stats.add(QOpenGLProgramBinaryCacheStats::Misses);
+        return false;
+    }
+    const QSharedPointer<QOpenGLProgramBinaryMapping> mapping = fdw.map();
+    if (!mapping) {
+        m_stats.add(QOpenGLProgramBinaryCacheStats::CorruptEntries);
+        undertaker.setActive();
         return false;
-    char header[HEADER_SIZE];
-    qint64 bytesRead = qt_safe_read(fdw.fd, header, HEADER_SIZE);
-    if (bytesRead == HEADER_SIZE)
-        buf = QByteArray::fromRawData(header, HEADER_SIZE);
+    }
+    m_stats.add(QOpenGLProgramBinaryCacheStats::BytesRead, qint64(mapping->size));
+    blob = parseEntry(static_cast<const uchar *>(mapping->ptr), qint64(mapping->size), &blobFormat, &blobSize, &buffer,
+                      &buildUsecs);
+    // Repeated loads then use the mapping, with the page cache the only copy.
+    const MemCacheBlob memEntry = buffer.isEmpty() ? MemCacheBlob(blob, blobSize, blobFormat, QByteArray(), mapping)
+                                                   : MemCacheBlob(blob, blobSize, blobFormat, buffer);
 #else
     QFile f(fn);
-    if (!f.open(QIODevice::ReadOnly))
+    if (!f.open(QIODevice::ReadOnly)) {
+        m_stats.add(QOpenGLProgramBinaryCacheStats::Misses);
         return false;
-    buf = f.read(HEADER_SIZE);
+    }
+    const QByteArray buf = f.readAll();
+    m_stats.add(QOpenGLProgramBinaryCacheStats::BytesRead, buf.size());
+    blob = parseEntry(reinterpret_cast<const uchar *>(buf.constData()), buf.size(), &blobFormat, &blobSize, &buffer,
+                      &buildUsecs);
+    const MemCacheBlob memEntry(blob, blobSize, blobFormat, buffer.isEmpty() ? buf : buffer);
 #endif
-
-    if (!verifyHeader(buf)) {
+    if (!blob) {
+        m_stats.add(QOpenGLProgramBinaryCacheStats::CorruptEntries);
         undertaker.setActive();
         return false;
     }
 
-    const quint32 *p;
-#ifdef Q_OS_UNIX
-    if (!fdw.map()) {
-        undertaker.setActive();
-        return false;
+    return useFileEntry(support, ns, cacheKey, programId, memEntry, buildUsecs, elapsed);
+}
+
+class QOpenGLProgramBinaryReader : public QRunnable
+{
+public:
+    QOpenGLProgramBinaryReader(QOpenGLProgramBinaryCache *cache, QOpenGLProgramBinaryCache::Namespace *ns,
+                               const QVector<QByteArray> &cacheKeys)
+        : m_cache(cache),
+          m_ns(ns),
+          m_cacheKeys(cacheKeys)
+    {
     }
-    p = reinterpret_cast<const quint32 *>(static_cast<const char *>(fdw.ptr) + HEADER_SIZE);
-#else
-    buf = f.readAll();
-    p = reinterpret_cast<const quint32 *>(buf.constData());
-#endif
 
-    GLEnvInfo info;
+    void run() override
+    {
+        for (const QByteArray &cacheKey : qAsConst(m_cacheKeys))
+            m_cache->prefetchEntry(m_ns, cacheKey);
+    }
 
-    quint32 v = *p++;
-    QByteArray vendor = QByteArray::fromRawData(reinterpret_cast<const char *>(p), v);
-    if (vendor != info.glvendor) {
-        qCDebug(DBG_SHADER_CACHE, "GL_VENDOR does not match (%s, %s)", qPrintable(vendor), qPrintable(info.glvendor));
-        undertaker.setActive();
-        return false;
+private:
+    QOpenGLProgramBinaryCache *m_cache;
+    QOpenGLProgramBinaryCache::Namespace *m_ns;
+    QVector<QByteArray> m_cacheKeys;
+};
+
+// Starts reading the given entries in the background, in order. A load() for
+// one of them waits for that read instead of doing its own, so with the GL
+// thread consuming entries in the same order the disk latency of one program
+// overlaps with the glProgramBinary of the previous one. At most
+// MAX_PREFETCHED_BYTES are held ahead of load(); entries beyond that are read
+// by load() as without prefetching.
+void QOpenGLProgramBinaryCache::prefetch(const QOpenGLProgramBinaryBackend *support,
+                                         const QVector<QByteArray> &cacheKeys)
+{
+    const QByteArray fingerprint = support->fingerprint();
+    Namespace *ns = cacheNamespace(fingerprint);
+    QVector<QByteArray> keys;
+    keys.reserve(cacheKeys.count());
+    {
+        QSet<QByteArray> rejected;
+        QSet<QByteArray> slow;
+        {
+            QMutexLocker locker(&m_namespaceLock);
+            if (m_adaptive && ns->diskDisabled)
+                return;
+            rejected = ns->rejected;
+            if (m_adaptive)
+                slow = ns->slow;
+        }
+        QMutexLocker locker(&m_prefetchLock);
+        for (const QByteArray &cacheKey : cacheKeys) {
+            MemCacheBlob memBlob;
+            if (m_prefetched.contains(cacheKey) || rejected.contains(cacheKey) || slow.contains(cacheKey)
+                    || memCacheLookup(fingerprint, cacheKey, &memBlob))
+                continue;
+            // a pack is mapped already, only its pages get read ahead
+            if (!ns->pack)
+                m_prefetched.insert(cacheKey, { ns, false, QByteArray() });
+            keys.append(cacheKey);
+        }
     }
-    p = reinterpret_cast<const quint32 *>(reinterpret_cast<const char *>(p) + v);
-    v = *p++;
-    QByteArray renderer = QByteArray::fromRawData(reinterpret_cast<const char *>(p), v);
-    if (renderer != info.glrenderer) {
-        qCDebug(DBG_SHADER_CACHE, "GL_RENDERER does not match (%s, %s)", qPrintable(renderer), qPrintable(info.glrenderer));
-        undertaker.setActive();
-        return false;
+    if (!keys.isEmpty())
+        m_readerPool.start(new QOpenGLProgramBinaryReader(this, ns, keys));
+}
+
+// Forgets prefetched entries that were not consumed by load().
+void QOpenGLProgramBinaryCache::dropPrefetched(const QVector<QByteArray> &cacheKeys)
+{
+    QMutexLocker locker(&m_prefetchLock);
+    for (const QByteArray &cacheKey : cacheKeys)
+        m_prefetchedBytes -= m_prefetched.take(cacheKey).data.size();
+    m_prefetchDone.wakeAll();
+}
+
+class QOpenGLProgramBinaryWarmUp : public QRunnable
+{
+public:
+    QOpenGLProgramBinaryWarmUp(QOpenGLProgramBinaryCache *cache)
+        : m_cache(cache)
+    {
     }
-    p = reinterpret_cast<const quint32 *>(reinterpret_cast<const char *>(p) + v);
-    v = *p++;
-    QByteArray version = QByteArray::fromRawData(reinterpret_cast<const char *>(p), v);
-    if (version != info.glversion) {
-        qCDebug(DBG_SHADER_CACHE, "GL_VERSION does not match (%s, %s)", qPrintable(version), qPrintable(info.glversion));
-        undertaker.setActive();
-        return false;
+
+    void run() override
+    {
+        m_cache->warmUpEntries();
     }
-    p = reinterpret_cast<const quint32 *>(reinterpret_cast<const char *>(p) + v);
 
-    quint32 blobFormat = *p++;
-    quint32 blobSize = *p++;
+private:
+    QOpenGLProgramBinaryCache *m_cache;
+};
 
-    const bool ok = setProgramBinary(programId, blobFormat, p, blobSize);
-    if (ok)
-        m_memCache.insert(cacheKey, new MemCacheEntry(p, blobSize, blobFormat));
+// Meant for application startup, before a context exists: reads the most
+// recently used entries of the driver seen last into the memory cache, up to
+// its budget, so that the first load() calls do not touch the disk. A pack is
+// mapped anyway, so the kernel is only asked to read it in.
+void QOpenGLProgramBinaryCache::warmUp()
+{
+    m_readerPool.start(new QOpenGLProgramBinaryWarmUp(this));
+}
 
-    return ok;
+void QOpenGLProgramBinaryCache::warmUpEntries()
+{
+    // Only reads: the namespace used last need not be the one this run's
+    // driver asks for, so it is neither opened nor stamped here.
+    QByteArray fingerprint;
+    QDateTime newest;
+    const QFileInfoList namespaces = QDir(m_cacheDir).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (const QFileInfo &fi : namespaces) {
+        if (!isCacheFileName(fi.fileName()))
+            continue;
+        const QDateTime used = lastUsed(fi);
+        if (fingerprint.isEmpty() || used > newest) {
+            fingerprint = fi.fileName().toLatin1();
+            newest = used;
+        }
+    }
+    if (fingerprint.isEmpty())
+        return;
+
+    Namespace probe;
+    probe.pack = nullptr;
+    probe.dir = m_cacheDir + QString::fromLatin1(fingerprint) + QLatin1Char('/');
+    readPolicy(&probe);
+    const bool adaptive = isAdaptive();
+    if (probe.diskDisabled && adaptive)
+        return;
+    if (m_usePack) {
+        QOpenGLProgramBinaryPack::readAhead(probe.dir);
+        return;
+    }
+
+    // load() never uses these, they would only take the place of entries it does
+    probe.rejected = readKeyFile(probe.dir + QLatin1String(REJECTED_FILE));
+    if (!adaptive)
+        probe.slow.clear();
+
+    qint64 budget = maxMemorySize();
+    int count = 0;
+    const QFileInfoList entries = QDir(probe.dir).entryInfoList(QDir::Files, QDir::Time);
+    for (const QFileInfo &fi : entries) {
+        if (fi.fileName().contains(QLatin1Char('.')))
+            continue;
+        // what does not fit would only be read to be dropped again
+        if (fi.size() > budget)
+            continue;
+        const QByteArray cacheKey = QByteArray::fromHex(fi.fileName().toLatin1());
+        if (probe.rejected.contains(cacheKey) || probe.slow.contains(cacheKey))
+            continue;
+        QFile ef(fi.filePath());
+        if (!ef.open(QIODevice::ReadOnly))
+            continue;
+        const QByteArray data = ef.readAll();
+        m_stats.add(QOpenGLProgramBinaryCacheStats::BytesRead, data.size());
+        quint32 blobFormat = 0;
+        quint32 blobSize = 0;
+        QByteArray buffer;
+        const uchar *blob = parseEntry(reinterpret_cast<const uchar *>(data.constData()), data.size(),
+                                       &blobFormat, &blobSize, &buffer);
+        if (!blob || blobSize > budget)
+            continue;
+        memCacheInsert(fingerprint, cacheKey,
+                       MemCacheBlob(blob, blobSize, blobFormat, buffer.isEmpty() ? data : buffer), true);
+        budget -= blobSize;
+        ++count;
+    }
+    qCDebug(DBG_SHADER_CACHE, "Warmed up %d entries from %s", count, qPrintable(probe.dir));
 }
 
-void QOpenGLProgramBinaryCache::save(const QByteArray &cacheKey, uint programId)
+void QOpenGLProgramBinaryCache::prefetchEntry(Namespace *ns, const QByteArray &cacheKey)
 {
-    if (!m_cacheWritable)
+    if (ns->pack) {
+        ns->pack->willNeed(cacheKey);
         return;
+    }
 
-    GLEnvInfo info;
+    {
+        QMutexLocker locker(&m_prefetchLock);
+        if (!m_prefetched.contains(cacheKey))
+            return;
+    }
 
-    QOpenGLExtraFunctions *funcs = QOpenGLContext::currentContext()->extraFunctions();
-    GLint blobSize = 0;
-    funcs->glGetError();
-    funcs->glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &blobSize);
-    int totalSize = blobSize + 8 + 12 + 12 + info.glvendor.count() + info.glrenderer.count() + info.glversion.count();
-    qCDebug(DBG_SHADER_CACHE, "Program binary is %d bytes, err = 0x%x, total %d", blobSize, funcs->glGetError(), totalSize);
-    if (!blobSize)
+    QByteArray data;
+    qint64 reserved = 0;
+    QFile f(cacheFileName(ns, cacheKey));
+    if (f.open(QIODevice::ReadOnly)) {
+        {
+            // Beyond the cap, load() reads the entry itself when it gets to it.
+            QMutexLocker locker(&m_prefetchLock);
+            reserved = f.size();
+            if (m_prefetchedBytes > 0 && m_prefetchedBytes + reserved > MAX_PREFETCHED_BYTES) {
+                m_prefetched.remove(cacheKey);
+                m_prefetchDone.wakeAll();
+                return;
+            }
+            m_prefetchedBytes += reserved;
+        }
+        data = f.readAll();
+        m_stats.add(QOpenGLProgramBinaryCacheStats::BytesRead, data.size());
+        data = decompressEntry(data);
+    }
+
+    QMutexLocker locker(&m_prefetchLock);
+    m_prefetchedBytes -= reserved;
+    auto it = m_prefetched.find(cacheKey);
+    if (it == m_prefetched.end())
         return;
+    it->data = data;
+    it->done = true;
+    m_prefetchedBytes += data.size();
+    m_prefetchDone.wakeAll();
+}
+
+QOpenGLProgramBinaryCache::PrefetchResult QOpenGLProgramBinaryCache::takePrefetched(Namespace *ns, const QByteArray &cacheKey,
+                                                                                    QByteArray *data)
+{
+    QMutexLocker locker(&m_prefetchLock);
+    auto it = m_prefetched.find(cacheKey);
+    while (it != m_prefetched.end() && it->ns == ns && !it->done) {
+        m_prefetchDone.wait(&m_prefetchLock);
+        it = m_prefetched.find(cacheKey);
+    }
+    if (it == m_prefetched.end() || it->ns != ns)
+        return NotPrefetched;
+    *data = it->data;
+    m_prefetchedBytes -= data->size();
+    m_prefetched.erase(it);
+    return data->isEmpty() ? PrefetchMissing : PrefetchDone;
+}
+
+// Whether save() is going to take the binary of the program, as opposed to
+// turning it down as rejected before or as not worth caching.
+bool QOpenGLProgramBinaryCache::willSave(const QOpenGLProgramBinaryBackend *support, const QByteArray &cacheKey)
+{
+    if (!m_cacheWritable)
+        return false;
+    Namespace *ns = cacheNamespace(support->fingerprint());
+    return !isRejected(ns, cacheKey) && !skipsCache(ns, cacheKey);
+}
+
+// buildNsecs is how long compiling and linking the program took, 0 if not
+// known. Returns whether the binary was taken, and so can relink the program.
+bool QOpenGLProgramBinaryCache::save(const QOpenGLProgramBinaryBackend *support, const QByteArray &cacheKey, uint programId,
+                                     qint64 buildNsecs)
+{
+    if (!m_cacheWritable)
+        return false;
+    const QByteArray fingerprint = support->fingerprint();
+    Namespace *ns = cacheNamespace(fingerprint);
+    if (isRejected(ns, cacheKey))
+        return false;
+    if (skipsCache(ns, cacheKey)) {
+        m_stats.add(QOpenGLProgramBinaryCacheStats::PolicySkips);
+        return false;
+    }
+
+    QOpenGLProgramBinaryCacheStats::Timing timing(&m_stats, QOpenGLProgramBinaryCacheStats::SaveTime);
+    const uint blobSize = support->programBinaryLength(programId);
+    if (!blobSize || blobSize > uint(std::numeric_limits<int>::max() - ENTRY_HEADER_SIZE))
+        return false;
+    const int totalSize = ENTRY_HEADER_SIZE + int(blobSize);
 
     QByteArray blob;
     blob.resize(totalSize);
@@ -290,30 +1842,41 @@ void QOpenGLProgramBinaryCache::save(const QByteArray &cacheKey, uint programId)
     *p++ = BINSHADER_VERSION;
     *p++ = BINSHADER_QTVERSION;
 
-    *p++ = info.glvendor.count();
-    memcpy(p, info.glvendor.constData(), info.glvendor.count());
-    p = reinterpret_cast<quint32 *>(reinterpret_cast<char *>(p) + info.glvendor.count());
-    *p++ = info.glrenderer.count();
-    memcpy(p, info.glrenderer.constData(), info.glrenderer.count());
-    p = reinterpret_cast<quint32 *>(reinterpret_cast<char *>(p) + info.glrenderer.count());
-    *p++ = info.glversion.count();
-    memcpy(p, info.glversion.constData(), info.glversion.count());
-    p = reinterpret_cast<quint32 *>(reinterpret_cast<char *>(p) + info.glversion.count());
-        
     quint32 blobFormat = 0;
-    GLint outSize = 0;
     quint32 *fmtP = p++;
     *p++ = blobSize;
-    funcs->glGetProgramBinary(programId, blobSize, &outSize, &blobFormat, p);
+    *p++ = m_storeBuildTimes && buildNsecs > 0 ? quint32(qBound<qint64>(1, buildNsecs / 1000, std::numeric_limits<quint32>::max())) : 0;
+    const uint outSize = support->getProgramBinary(programId, blobSize, &blobFormat, p);
     if (blobSize != outSize) {
-        qCDebug(DBG_SHADER_CACHE, "glGetProgramBinary returned size %d instead of %d", outSize, blobSize);
-        return;
+        qCDebug(DBG_SHADER_CACHE, "glGetProgramBinary returned size %u instead of %u", outSize, blobSize);
+        return false;
     }
     *fmtP = blobFormat;
 
-    QFile f(cacheFileName(cacheKey));
-    if (f.open(QIODevice::WriteOnly | QIODevice::Truncate))
-        f.write(blob);
+    // Keep it in memory too: the pack only maps what was there on open and the
+    // write is asynchronous, so a later load in this process would otherwise miss.
+    memCacheInsert(fingerprint, cacheKey, MemCacheBlob(p, blobSize, blobFormat, blob));
+
+    m_writer->enqueue(ns, cacheKey, blob);
+    return true;
+}
+
+void QOpenGLProgramBinaryCache::writeEntry(Namespace *ns, const QByteArray &cacheKey, const QByteArray &entry)
+{
+    const QByteArray data = m_compress ? compressEntry(entry) : entry;
+    if (ns->pack) {
+        if (ns->pack->append(cacheKey, data))
+            m_stats.add(QOpenGLProgramBinaryCacheStats::BytesWritten, data.size());
+        else
+            qCDebug(DBG_SHADER_CACHE, "Failed to append program to shader cache pack");
+        return;
+    }
+
+    // Published by renaming a complete temporary file, so that readers, in this
+    // or another process, never see a partial entry.
+    QSaveFile f(cacheFileName(ns, cacheKey));
+    if (f.open(QIODevice::WriteOnly) && f.write(data) == data.size() && f.commit())
+        m_stats.add(QOpenGLProgramBinaryCacheStats::BytesWritten, data.size());
     else
         qCDebug(DBG_SHADER_CACHE, "Failed to write %s to shader cache", qPrintable(f.fileName()));
 }
@@ -42,42 +42,346 @@
 
 #include <QtGui/qtguiglobal.h>
 #include <QtGui/qopenglshaderprogram.h>
+#include <QtGui/qopenglfunctions.h>
 #include <QtCore/qcache.h>
+#include <QtCore/qhash.h>
+#include <QtCore/qset.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qwaitcondition.h>
+#include <QtCore/qthreadpool.h>
+#include <QtCore/qatomic.h>
+#include <QtCore/qelapsedtimer.h>
+#include <QtCore/qjsonobject.h>
+#include <QtCore/qbytearraylist.h>
+#include <QtCore/qsharedpointer.h>
+#include <QtCore/qobjectdefs.h>
+#include <QtGui/private/qopenglcontext_p.h>
 
 QT_BEGIN_NAMESPACE
 
+class QOpenGLProgramBinaryPack;
+class QOpenGLProgramBinaryWriter;
+class QOpenGLProgramBinaryReader;
+class QOpenGLProgramBinaryWarmUp;
+class QOpenGLProgramBinaryMapping;
+
+// What the cache needs from the driver. QOpenGLProgramBinarySupportCheck is the
+// OpenGL implementation; others allow exercising the file format and the I/O
+// without a GL implementation, e.g. for benchmarks.
+class QOpenGLProgramBinaryBackend
+{
+public:
+    virtual ~QOpenGLProgramBinaryBackend() { }
+
+    // Hash of the driver strings and the cache format. Entries are stored in a
+    // subdirectory named after it, so binaries from another driver are never opened.
+    virtual QByteArray fingerprint() const = 0;
+
+    // Returns whether the program is linked after being given the binary.
+    virtual bool programBinary(uint programId, uint binaryFormat, const void *binary, uint length) const = 0;
+    // Returns 0 when the program has no binary.
+    virtual uint programBinaryLength(uint programId) const = 0;
+    // Returns the number of bytes written to binary.
+    virtual uint getProgramBinary(uint programId, uint bufSize, uint *binaryFormat, void *binary) const = 0;
+};
+
+// While unlikely, one application can in theory use contexts with different versions
+// or profiles. Therefore any version- or extension-specific checks must be done on a
+// per-context basis, not just once per process. QOpenGLSharedResource enables this,
+// although it's once-per-sharing-context-group, not per-context. Still, this should
+// be good enough in practice.
+class QOpenGLProgramBinarySupportCheck : public QOpenGLSharedResource, public QOpenGLProgramBinaryBackend
+{
+public:
+    QOpenGLProgramBinarySupportCheck(QOpenGLContext *context);
+    void invalidateResource() override { }
+    void freeResource(QOpenGLContext *) override { }
+
+    bool isSupported() const { return m_supported; }
+    bool hasParallelShaderCompile() const { return m_parallelShaderCompile; }
+
+    QByteArray fingerprint() const override { return m_fingerprint; }
+
+    // glGetProgramBinary and glProgramBinary, or their GL_OES_get_program_binary
+    // counterparts on OpenGL ES 2.0.
+    bool programBinary(uint programId, uint binaryFormat, const void *binary, uint length) const override;
+    uint programBinaryLength(uint programId) const override;
+    uint getProgramBinary(uint programId, uint bufSize, uint *binaryFormat, void *binary) const override;
+    void setRetrievableHint(GLuint program) const;
+
+private:
+    typedef void (QOPENGLF_APIENTRYP GetProgramBinaryOES)(GLuint program, GLsizei bufSize, GLsizei *length,
+                                                        GLenum *binaryFormat, void *binary);
+    typedef void (QOPENGLF_APIENTRYP ProgramBinaryOES)(GLuint program, GLenum binaryFormat,
+                                                     const void *binary, GLint length);
+
+    bool m_supported;
+    bool m_parallelShaderCompile;
+    QByteArray m_fingerprint;
+    GetProgramBinaryOES m_getProgramBinaryOES;
+    ProgramBinaryOES m_programBinaryOES;
+};
+
+class QOpenGLProgramBinarySupportCheckWrapper
+{
+public:
+    QOpenGLProgramBinarySupportCheck *get(QOpenGLContext *context)
+    {
+        return m_resource.value<QOpenGLProgramBinarySupportCheck>(context);
+    }
+
+private:
+    QOpenGLMultiGroupSharedResource m_resource;
+};
+
+// Counters and timings for monitoring, updated lock-free from any thread.
+// Times are kept as a total plus a histogram of power-of-two microsecond
+// buckets.
+class QOpenGLProgramBinaryCacheStats
+{
+public:
+    enum Counter {
+        MemoryHits,
+        DiskHits,
+        Misses,
+        DriverRejects,
+        NegativeHits,
+        SlowHits,
+        PolicySkips,
+        CorruptEntries,
+        BytesRead,
+        BytesWritten,
+        CounterCount
+    };
+    enum Timer {
+        HashTime,
+        LoadTime,
+        ProgramBinaryTime,
+        CompileTime,
+        LinkTime,
+        SaveTime,
+        TimerCount
+    };
+    enum { HistogramBuckets = 24 };
+
+    QOpenGLProgramBinaryCacheStats() { reset(); }
+
+    void add(Counter c, qint64 value = 1) { m_counters[c].fetchAndAddRelaxed(value); }
+    void addTime(Timer t, qint64 nsecs);
+    void reset();
+    QJsonObject toJson() const;
+
+    class Timing
+    {
+    public:
+        Timing(QOpenGLProgramBinaryCacheStats *stats, Timer t) : m_stats(stats), m_timer(t) { m_elapsed.start(); }
+        ~Timing() { m_stats->addTime(m_timer, m_elapsed.nsecsElapsed()); }
+
+    private:
+        QOpenGLProgramBinaryCacheStats *m_stats;
+        Timer m_timer;
+        QElapsedTimer m_elapsed;
+    };
+
+private:
+    QAtomicInteger<qint64> m_counters[CounterCount];
+    QAtomicInteger<qint64> m_timeTotal[TimerCount];
+    QAtomicInteger<qint64> m_timeCount[TimerCount];
+    QAtomicInteger<qint64> m_histogram[TimerCount][HistogramBuckets];
+};
+
 class QOpenGLProgramBinaryCache
 {
 public:
     struct ShaderDesc {
         QOpenGLShader::ShaderType type;
         QByteArray source;
+        // Turned into #define lines right after the #version directive when
+        // compiling. Keyed separately, so permutations of a source share its digest.
+        QByteArrayList defines;
     };
     struct ProgramDesc {
         QVector<ShaderDesc> shaders;
     };
 
     QOpenGLProgramBinaryCache();
+    ~QOpenGLProgramBinaryCache();
+
+    static QByteArray cacheKey(const ProgramDesc &program);
+    static QByteArray internSource(const char *source);
+
+    bool load(const QOpenGLProgramBinaryBackend *support, const QByteArray &cacheKey, uint programId);
+    bool save(const QOpenGLProgramBinaryBackend *support, const QByteArray &cacheKey, uint programId,
+              qint64 buildNsecs = 0);
+    bool willSave(const QOpenGLProgramBinaryBackend *support, const QByteArray &cacheKey);
+    void flush();
 
-    bool load(const QByteArray &cacheKey, uint programId);
-    void save(const QByteArray &cacheKey, uint programId);
+    void prefetch(const QOpenGLProgramBinaryBackend *support, const QVector<QByteArray> &cacheKeys);
+    void dropPrefetched(const QVector<QByteArray> &cacheKeys);
+    void warmUp();
+
+    void setMaxDiskSize(qint64 size);
+    qint64 maxDiskSize();
+
+    void setMaxMemorySize(qint64 size);
+    qint64 maxMemorySize();
+    qint64 memorySize();
+
+    void setAdaptive(bool enable);
+    bool isAdaptive();
+
+    bool keepsEntries();
+
+    QOpenGLProgramBinaryCacheStats *stats() { return &m_stats; }
+    void dumpStats();
 
 private:
-    QString cacheFileName(const QByteArray &cacheKey) const;
+    friend class QOpenGLProgramBinaryWriter;
+    friend class QOpenGLProgramBinaryReader;
+    friend class QOpenGLProgramBinaryWarmUp;
+
+    // A binary in memory without a copy of its own. It points into storage, a
+    // buffer shared with whatever read or produced it, into a file mapping kept
+    // alive by mapping, or, with neither, into the mapping of a pack, which
+    // lives as long as the cache.
+    struct MemCacheBlob {
+        MemCacheBlob() : data(nullptr), size(0), format(0) { }
+        MemCacheBlob(const void *data, quint32 size, quint32 format, const QByteArray &storage = QByteArray(),
+                     const QSharedPointer<QOpenGLProgramBinaryMapping> &mapping = QSharedPointer<QOpenGLProgramBinaryMapping>())
+          : data(data),
+            size(int(size)),
+            format(format),
+            storage(storage),
+            mapping(mapping)
+        { }
+        const void *data;
+        int size;
+        uint format;
+        QByteArray storage;
+        QSharedPointer<QOpenGLProgramBinaryMapping> mapping;
+    };
+
+    // Value-initialized to no strikes by QHash::operator[].
+    struct SlowKey {
+        int strikes;
+        int lastSlowRun;
+    };
+
+    struct Namespace {
+        QString dir;
+        QOpenGLProgramBinaryPack *pack;
+        // Since last.used was last written.
+        QElapsedTimer stamped;
+        QSet<QByteArray> touched;
+        // Keys whose binaries the driver did not accept. Persistent, so that
+        // they are compiled right away in later runs too.
+        QSet<QByteArray> rejected;
+        // Adaptive policy. Runs of this namespace are counted; slowKeys are
+        // the programs with slow loads in a row, and the run of the last one.
+        // slow and diskDisabled are what is in effect in this run.
+        int run = 0;
+        QHash<QByteArray, SlowKey> slowKeys;
+        QSet<QByteArray> slow;
+        bool diskDisabled = false;
+        // Runs in a row with most loads slow, and the one that disabled the
+        // disk, if any.
+        int slowRuns = 0;
+        int disabledRun = 0;
+        // Disk hits of this run timed against the build time stored in their
+        // entry, and how many of those were slow.
+        int runHits = 0;
+        int runSlowHits = 0;
+        bool policyDirty = false;
+    };
+
+    Namespace *cacheNamespace(const QByteArray &fingerprint);
+    static void readPolicy(Namespace *ns);
+    void stampNamespace(Namespace *ns);
+    void writeEntry(Namespace *ns, const QByteArray &cacheKey, const QByteArray &entry);
+    bool isRejected(Namespace *ns, const QByteArray &cacheKey);
+    void reject(Namespace *ns, const QByteArray &cacheKey);
+    void writeRejection(Namespace *ns, const QByteArray &cacheKey);
+    void removeEntry(Namespace *ns, const QByteArray &cacheKey);
+    bool skipsCache(Namespace *ns, const QByteArray &cacheKey);
+    void recordDiskHit(Namespace *ns, const QByteArray &cacheKey, quint32 buildUsecs, qint64 nsecs);
+    void writePolicy(Namespace *ns);
+    void purgeStale();
+    void evict(Namespace *ns);
+    QString cacheFileName(const Namespace *ns, const QByteArray &cacheKey) const;
     bool verifyHeader(const QByteArray &buf) const;
-    bool setProgramBinary(uint programId, uint blobFormat, const void *p, uint blobSize);
+    const uchar *parseEntry(const uchar *data, qint64 size, quint32 *blobFormat, quint32 *blobSize,
+                            QByteArray *buffer, quint32 *buildUsecs = nullptr) const;
+    QByteArray compressEntry(const QByteArray &entry) const;
+    QByteArray decompressEntry(const QByteArray &entry) const;
+    bool setProgramBinary(const QOpenGLProgramBinaryBackend *support, uint programId, uint blobFormat,
+                          const void *p, uint blobSize);
+    bool useFileEntry(const QOpenGLProgramBinaryBackend *support, Namespace *ns, const QByteArray &cacheKey, uint programId,
+                      const MemCacheBlob &blob, quint32 buildUsecs, const QElapsedTimer &elapsed);
+
+    // Entries read ahead by a worker thread for load() calls expected soon.
+    enum PrefetchResult {
+        NotPrefetched,
+        PrefetchMissing,
+        PrefetchDone
+    };
+    struct PrefetchEntry {
+        Namespace *ns;
+        bool done;
+        QByteArray data;
+    };
+    void prefetchEntry(Namespace *ns, const QByteArray &cacheKey);
+    PrefetchResult takePrefetched(Namespace *ns, const QByteArray &cacheKey, QByteArray *data);
+    void warmUpEntries();
 
     QString m_cacheDir;
     bool m_cacheWritable;
+    bool m_shared;
+    bool m_usePack;
+    bool m_compress;
+    bool m_adaptive;
+    bool m_storeBuildTimes;
+    qint64 m_maxDiskSize;
+    QMutex m_namespaceLock;
+    QHash<QByteArray, Namespace *> m_namespaces;
+    QOpenGLProgramBinaryWriter *m_writer;
+    QMutex m_prefetchLock;
+    QWaitCondition m_prefetchDone;
+    QHash<QByteArray, PrefetchEntry> m_prefetched;
+    qint64 m_prefetchedBytes;
+    QThreadPool m_readerPool;
     struct MemCacheEntry {
-        MemCacheEntry(const void *p, int size, uint format)
-          : blob(reinterpret_cast<const char *>(p), size),
-            format(format)
+        MemCacheEntry(const QByteArray &fingerprint, const MemCacheBlob &blob, bool warmedUp)
+          : fingerprint(fingerprint),
+            blob(blob),
+            warmedUp(warmedUp)
         { }
-        QByteArray blob;
-        uint format;
+        QByteArray fingerprint;
+        MemCacheBlob blob;
+        bool warmedUp;
     };
-    QCache<QByteArray, MemCacheEntry> m_memCache;
+    // Costed in bytes. Sharded so that render threads loading different
+    // programs do not serialize on one lock; the budget is shared by all.
+    struct MemCacheShard {
+        QMutex lock;
+        QCache<QByteArray, MemCacheEntry> cache;
+    };
+    enum { MemCacheShardCount = 8 };
+    MemCacheShard &memCacheShard(const QByteArray &cacheKey);
+    bool memCacheLookup(const QByteArray &fingerprint, const QByteArray &cacheKey, MemCacheBlob *blob,
+                        bool *warmedUp = nullptr);
+    void memCacheInsert(const QByteArray &fingerprint, const QByteArray &cacheKey, const MemCacheBlob &blob,
+                        bool warmedUp = false);
+    void trimMemCache(qint64 budget);
+
+    MemCacheShard m_memCache[MemCacheShardCount];
+    QAtomicInt m_memCacheTrimShard;
+    qint64 m_maxMemorySize;
+
+    QOpenGLProgramBinaryCacheStats m_stats;
+    QString m_statsFile;
+    QAtomicInt m_statsDumped;
+    QMetaObject::Connection m_quitConnection;
+    QAtomicInt m_purgeStarted;
 };
 
 QT_END_NAMESPACE
@@ -0,0 +1,565 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the QtGui module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see https://www.qt.io/terms-conditions. For further
+** information use the contact form at https://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl-3.0.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or (at your option) the GNU General
+** Public license version 3 or any later version approved by the KDE Free
+** Qt Foundation. The licenses are as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL2 and LICENSE.GPL3
+** included in the packaging of this file. Please review the following
+** information to ensure the GNU General Public License requirements will
+** be met: https://www.gnu.org/licenses/gpl-2.0.html and
+** https://www.gnu.org/licenses/gpl-3.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qopenglprogrambinarypack_p.h"
+#include <QSaveFile>
+#include <QLoggingCategory>
+#include <QVector>
+#include <algorithm>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <QFileInfo>
+#endif
+
+QT_BEGIN_NAMESPACE
+
+Q_DECLARE_LOGGING_CATEGORY(DBG_SHADER_CACHE)
+
+// Pack layout: header, then records of [magic, key size, data size, key, data],
+// each part padded to 4 bytes. Records are only ever appended. The index file
+// holds the (key hash, record offset) pairs sorted by hash for all records up
+// to coveredSize; anything after that (a crash before the index was rewritten)
+// is recovered by scanning the tail of the pack on open. Each index entry also
+// carries the generation (one per process that flushed the index) in which it
+// was last used, which drives the LRU order when the pack is compacted.
+
+const quint32 BINPACK_MAGIC = 0x5175;
+const quint32 BINPACK_VERSION = 0x2;
+const quint32 BINPACK_RECORD_MAGIC = 0x5176;
+const quint32 BINPACK_INDEX_MAGIC = 0x5177;
+const quint32 BINPACK_QTVERSION = QT_VERSION;
+
+static const quint32 PACK_HEADER_SIZE = 3 * sizeof(quint32);
+static const quint32 RECORD_HEADER_SIZE = 3 * sizeof(quint32);
+static const quint32 INDEX_HEADER_SIZE = 6 * sizeof(quint32);
+
+// How long to wait for another process to finish updating a shared pack before
+// giving up on the write. Whatever it was is only a cache entry.
+static const int SHARED_LOCK_TIMEOUT = 5000;
+
+static inline quint32 padded(quint32 size)
+{
+    return (size + 3) & ~3U;
+}
+
+static inline quint32 recordSize(quint32 keySize, quint32 dataSize)
+{
+    return RECORD_HEADER_SIZE + padded(keySize) + padded(dataSize);
+}
+
+namespace {
+struct SharedLocker
+{
+    SharedLocker(QLockFile *lockFile)
+        : lockFile(lockFile),
+          locked(!lockFile || lockFile->tryLock(SHARED_LOCK_TIMEOUT))
+    {
+        if (!locked)
+            qCDebug(DBG_SHADER_CACHE, "Timed out waiting for %s", qPrintable(lockFile->fileName()));
+    }
+    ~SharedLocker()
+    {
+        if (lockFile && locked)
+            lockFile->unlock();
+    }
+    QLockFile *lockFile;
+    bool locked;
+};
+}
+
+static quint64 keyHash(const QByteArray &key)
+{
+    // FNV-1a, stable across processes unlike qHash
+    quint64 h = Q_UINT64_C(14695981039346656037);
+    for (char c : key) {
+        h ^= uchar(c);
+        h *= Q_UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+QOpenGLProgramBinaryPack::QOpenGLProgramBinaryPack(const QString &dir, bool shared)
+    : m_packFileName(dir + QLatin1String("programs.pack")),
+      m_indexFileName(dir + QLatin1String("programs.idx")),
+      m_packData(nullptr),
+      m_packMapSize(0),
+      m_packSize(0),
+      m_index(nullptr),
+      m_indexCount(0),
+      m_generation(1),
+      m_dirty(false),
+      m_frozen(false),
+      m_lockFile(shared ? new QLockFile(dir + QLatin1String("programs.lock")) : nullptr)
+{
+    // Also opened when the lock cannot be had; the mapping is consistent
+    // either way, at worst with a partially written record to ignore.
+    SharedLocker sharedLock(m_lockFile.data());
+    open();
+    qCDebug(DBG_SHADER_CACHE, "Pack '%s' opened, %d indexed and %d unindexed entries, %u bytes",
+            qPrintable(m_packFileName), m_indexCount, m_tail.count(), m_packSize);
+}
+
+QOpenGLProgramBinaryPack::~QOpenGLProgramBinaryPack()
+{
+    flush();
+}
+
+void QOpenGLProgramBinaryPack::open()
+{
+    m_packFile.setFileName(m_packFileName);
+    if (!m_packFile.open(QIODevice::ReadOnly))
+        return; // nothing cached yet, append() creates the pack
+
+    const qint64 size = m_packFile.size();
+    if (size >= PACK_HEADER_SIZE && size <= std::numeric_limits<quint32>::max())
+        m_packData = m_packFile.map(0, size);
+
+    const quint32 *h = reinterpret_cast<const quint32 *>(m_packData);
+    if (!h || h[0] != BINPACK_MAGIC || h[1] != BINPACK_VERSION || h[2] != BINPACK_QTVERSION) {
+        qCDebug(DBG_SHADER_CACHE, "Pack header does not match, discarding pack");
+        m_packData = nullptr;
+        m_packFile.close();
+        QFile::remove(m_packFileName);
+        QFile::remove(m_indexFileName);
+        return;
+    }
+    m_packMapSize = m_packSize = quint32(size);
+
+    quint32 covered = PACK_HEADER_SIZE;
+    m_indexFile.setFileName(m_indexFileName);
+    if (m_indexFile.open(QIODevice::ReadOnly)) {
+        const qint64 indexSize = m_indexFile.size();
+        const uchar *indexData = indexSize >= INDEX_HEADER_SIZE ? m_indexFile.map(0, indexSize) : nullptr;
+        const quint32 *ih = reinterpret_cast<const quint32 *>(indexData);
+        if (ih && ih[0] == BINPACK_INDEX_MAGIC && ih[1] == BINPACK_VERSION && ih[2] == BINPACK_QTVERSION
+                && ih[4] >= PACK_HEADER_SIZE && ih[4] <= m_packSize
+                && INDEX_HEADER_SIZE + qint64(ih[3]) * qint64(sizeof(IndexEntry)) <= indexSize) {
+            m_index = reinterpret_cast<const IndexEntry *>(indexData + INDEX_HEADER_SIZE);
+            m_indexCount = int(ih[3]);
+            covered = ih[4];
+            m_generation = ih[5] + 1;
+        } else {
+            qCDebug(DBG_SHADER_CACHE, "Pack index does not match, rebuilding");
+            m_indexFile.close();
+        }
+    }
+
+    scan(covered);
+}
+
+void QOpenGLProgramBinaryPack::scan(quint32 from)
+{
+    quint32 offset = from;
+    while (offset < m_packSize) {
+        QByteArray key;
+        const uchar *data;
+        quint32 size;
+        if (!recordAt(offset, &key, &data, &size)) {
+            // a partially written record, drop it and everything after
+            qCDebug(DBG_SHADER_CACHE, "Truncating pack at offset %u", offset);
+            m_packSize = offset;
+            m_dirty = true;
+            break;
+        }
+        const IndexEntry e = { keyHash(key), offset, recordSize(key.size(), size), m_generation, 0 };
+        if (!m_tail.contains(key)) {
+            const quint32 old = findRecord(key, e.keyHash);
+            if (old)
+                m_removed.insert(old);
+        }
+        m_tail.insert(QByteArray(key.constData(), key.size()), e);
+        offset += e.size;
+        m_dirty = true;
+    }
+}
+
+bool QOpenGLProgramBinaryPack::recordAt(quint32 offset, QByteArray *key, const uchar **data, quint32 *size) const
+{
+    if (!m_packData || offset < PACK_HEADER_SIZE || qint64(offset) + RECORD_HEADER_SIZE > m_packMapSize)
+        return false;
+
+    const quint32 *h = reinterpret_cast<const quint32 *>(m_packData + offset);
+    if (h[0] != BINPACK_RECORD_MAGIC)
+        return false;
+    const qint64 dataOffset = qint64(offset) + RECORD_HEADER_SIZE + padded(h[1]);
+    if (dataOffset + h[2] > m_packMapSize)
+        return false;
+
+    if (key)
+        *key = QByteArray::fromRawData(reinterpret_cast<const char *>(m_packData + offset + RECORD_HEADER_SIZE), int(h[1]));
+    if (data)
+        *data = m_packData + dataOffset;
+    if (size)
+        *size = h[2];
+    return true;
+}
+
+quint32 QOpenGLProgramBinaryPack::findRecord(const QByteArray &cacheKey, quint64 hash) const
+{
+    const auto it = m_tail.constFind(cacheKey);
+    if (it != m_tail.constEnd())
+        return it->offset;
+
+    const IndexEntry *end = m_index + m_indexCount;
+    const IndexEntry *e = std::lower_bound(m_index, end, hash,
+                                           [](const IndexEntry &e, quint64 h) { return e.keyHash < h; });
+    for ( ; e != end && e->keyHash == hash; ++e) {
+        if (m_removed.contains(e->offset))
+            continue;
+        QByteArray key;
+        if (recordAt(e->offset, &key, nullptr, nullptr) && key == cacheKey)
+            return e->offset;
+    }
+    return 0;
+}
+
+bool QOpenGLProgramBinaryPack::find(const QByteArray &cacheKey, const uchar **data, quint32 *size)
+{
+    QMutexLocker locker(&m_lock);
+    const quint32 offset = findRecord(cacheKey, keyHash(cacheKey));
+    // records appended by this process are past the mapping and will simply miss
+    if (!offset || !recordAt(offset, nullptr, data, size))
+        return false;
+    if (!m_tail.contains(cacheKey)) {
+        m_used.insert(offset);
+        m_dirty = true;
+    }
+    return true;
+}
+
+// Asks the kernel to start reading the record in, so the page faults in a
+// later find() do not stall the GL thread.
+void QOpenGLProgramBinaryPack::willNeed(const QByteArray &cacheKey)
+{
+#ifdef Q_OS_UNIX
+    const uchar *data;
+    quint32 size;
+    {
+        QMutexLocker locker(&m_lock);
+        const quint32 offset = findRecord(cacheKey, keyHash(cacheKey));
+        if (!offset || !recordAt(offset, nullptr, &data, &size))
+            return;
+    }
+    const quintptr pageSize = quintptr(sysconf(_SC_PAGESIZE));
+    const quintptr start = quintptr(data) & ~(pageSize - 1);
+    madvise(reinterpret_cast<void *>(start), quintptr(data) + size - start, MADV_WILLNEED);
+#else
+    Q_UNUSED(cacheKey);
+#endif
+}
+
+// Asks the kernel to read in the pack in dir, without opening it as a pack:
+// for warm-up, which cannot know yet whether this run will use it.
+void QOpenGLProgramBinaryPack::readAhead(const QString &dir)
+{
+#ifdef Q_OS_UNIX
+    const int fd = ::open(QFile::encodeName(dir + QLatin1String("programs.pack")).constData(), O_RDONLY);
+    if (fd == -1)
+        return;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    ::close(fd);
+#else
+    Q_UNUSED(dir);
+#endif
+}
+
+void QOpenGLProgramBinaryPack::remove(const QByteArray &cacheKey)
+{
+    QMutexLocker locker(&m_lock);
+    if (m_tail.remove(cacheKey)) {
+        m_dirty = true;
+        return;
+    }
+    const quint32 offset = findRecord(cacheKey, keyHash(cacheKey));
+    if (offset) {
+        m_removed.insert(offset);
+        m_dirty = true;
+    }
+}
+
+bool QOpenGLProgramBinaryPack::append(const QByteArray &cacheKey, const QByteArray &data)
+{
+    QMutexLocker locker(&m_lock);
+    if (m_frozen)
+        return false;
+    SharedLocker sharedLock(m_lockFile.data());
+    if (!sharedLock.locked || !syncShared())
+        return false;
+    if (!m_appendFile.isOpen()) {
+        m_appendFile.setFileName(m_packFileName);
+        if (!m_packSize) {
+            if (!m_appendFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+                return false;
+            const quint32 header[] = { BINPACK_MAGIC, BINPACK_VERSION, BINPACK_QTVERSION };
+            if (m_appendFile.write(reinterpret_cast<const char *>(header), PACK_HEADER_SIZE) != PACK_HEADER_SIZE) {
+                m_appendFile.close();
+                return false;
+            }
+            m_packSize = PACK_HEADER_SIZE;
+        } else {
+            if (!m_appendFile.open(QIODevice::ReadWrite))
+                return false;
+            if (m_appendFile.size() > m_packSize)
+                m_appendFile.resize(m_packSize);
+            m_appendFile.seek(m_packSize);
+        }
+    } else if (m_lockFile) {
+        // Other processes may have appended, or died halfway through a record.
+        if (m_appendFile.size() > m_packSize)
+            m_appendFile.resize(m_packSize);
+        m_appendFile.seek(m_packSize);
+    }
+
+    const quint32 size = recordSize(cacheKey.size(), data.size());
+    if (qint64(m_packSize) + size > std::numeric_limits<quint32>::max())
+        return false;
+
+    QByteArray record(int(size), '\0');
+    quint32 *h = reinterpret_cast<quint32 *>(record.data());
+    h[0] = BINPACK_RECORD_MAGIC;
+    h[1] = cacheKey.size();
+    h[2] = data.size();
+    memcpy(record.data() + RECORD_HEADER_SIZE, cacheKey.constData(), cacheKey.size());
+    memcpy(record.data() + RECORD_HEADER_SIZE + padded(cacheKey.size()), data.constData(), data.size());
+
+    if (m_appendFile.write(record) != size || (m_lockFile && !m_appendFile.flush())) {
+        qCDebug(DBG_SHADER_CACHE, "Failed to append to %s", qPrintable(m_packFileName));
+        m_appendFile.resize(m_packSize);
+        m_appendFile.seek(m_packSize);
+        return false;
+    }
+
+    const quint64 hash = keyHash(cacheKey);
+    const quint32 old = findRecord(cacheKey, hash);
+    if (old && !m_tail.contains(cacheKey))
+        m_removed.insert(old);
+    const IndexEntry e = { hash, m_packSize, size, m_generation, 0 };
+    m_tail.insert(cacheKey, e);
+    m_packSize += size;
+    m_dirty = true;
+    return true;
+}
+
+QVector<QOpenGLProgramBinaryPack::IndexEntry> QOpenGLProgramBinaryPack::liveEntries() const
+{
+    QVector<IndexEntry> entries;
+    entries.reserve(m_indexCount + m_tail.count());
+    for (int i = 0; i < m_indexCount; ++i) {
+        if (m_removed.contains(m_index[i].offset))
+            continue;
+        IndexEntry e = m_index[i];
+        if (m_used.contains(e.offset))
+            e.lastUse = m_generation;
+        entries.append(e);
+    }
+    for (const IndexEntry &e : qAsConst(m_tail))
+        entries.append(e);
+    return entries;
+}
+
+bool QOpenGLProgramBinaryPack::writeIndex(QVector<IndexEntry> entries, quint32 packSize)
+{
+    std::sort(entries.begin(), entries.end(),
+              [](const IndexEntry &a, const IndexEntry &b) { return a.keyHash < b.keyHash; });
+
+    QSaveFile f(m_indexFileName);
+    if (!f.open(QIODevice::WriteOnly)) {
+        qCDebug(DBG_SHADER_CACHE, "Failed to write %s", qPrintable(m_indexFileName));
+        return false;
+    }
+    const quint32 header[] = { BINPACK_INDEX_MAGIC, BINPACK_VERSION, BINPACK_QTVERSION,
+                               quint32(entries.count()), packSize, m_generation };
+    f.write(reinterpret_cast<const char *>(header), INDEX_HEADER_SIZE);
+    f.write(reinterpret_cast<const char *>(entries.constData()), entries.count() * sizeof(IndexEntry));
+    return f.commit();
+}
+
+void QOpenGLProgramBinaryPack::flush()
+{
+    QMutexLocker locker(&m_lock);
+    if (m_appendFile.isOpen())
+        m_appendFile.flush();
+    if (!m_dirty || m_frozen)
+        return;
+    SharedLocker sharedLock(m_lockFile.data());
+    if (!sharedLock.locked || !syncShared())
+        return;
+
+    if (writeIndex(liveEntries(), m_packSize))
+        m_dirty = false;
+}
+
+// Whether the file at m_packFileName is no longer the one this process has
+// open, because another process compacted or removed it.
+bool QOpenGLProgramBinaryPack::replacedOnDisk() const
+{
+    const QFile &f = m_appendFile.isOpen() ? m_appendFile : m_packFile;
+    if (!f.isOpen())
+        return false;
+#ifdef Q_OS_UNIX
+    struct stat opened, onDisk;
+    if (::fstat(f.handle(), &opened) != 0)
+        return false;
+    if (::stat(QFile::encodeName(m_packFileName).constData(), &onDisk) != 0)
+        return true;
+    return opened.st_dev != onDisk.st_dev || opened.st_ino != onDisk.st_ino;
+#else
+    return QFileInfo(m_packFileName).size() < m_packSize;
+#endif
+}
+
+// Called with the lock file held, before changing a shared pack or its index.
+// Picks up the records other processes appended since this one last looked.
+// A pack that got replaced is left alone for the rest of the session, like
+// after compacting it here.
+bool QOpenGLProgramBinaryPack::syncShared()
+{
+    if (!m_lockFile)
+        return true;
+    if (replacedOnDisk()) {
+        qCDebug(DBG_SHADER_CACHE, "%s was replaced by another process", qPrintable(m_packFileName));
+        m_appendFile.close();
+        m_frozen = true;
+        return false;
+    }
+
+    QFile f(m_packFileName);
+    if (!f.open(QIODevice::ReadOnly))
+        return true;
+    const qint64 fileSize = qMin<qint64>(f.size(), std::numeric_limits<quint32>::max());
+    if (!m_packSize) {
+        // created by another process after open()
+        quint32 header[3];
+        if (f.read(reinterpret_cast<char *>(header), PACK_HEADER_SIZE) != PACK_HEADER_SIZE
+                || header[0] != BINPACK_MAGIC || header[1] != BINPACK_VERSION || header[2] != BINPACK_QTVERSION)
+            return true;
+        m_packSize = PACK_HEADER_SIZE;
+    }
+
+    int count = 0;
+    quint32 offset = m_packSize;
+    while (offset + qint64(RECORD_HEADER_SIZE) <= fileSize) {
+        quint32 h[3];
+        if (!f.seek(offset) || f.read(reinterpret_cast<char *>(h), RECORD_HEADER_SIZE) != RECORD_HEADER_SIZE
+                || h[0] != BINPACK_RECORD_MAGIC || h[1] > fileSize - offset || h[2] > fileSize - offset
+                || offset + qint64(recordSize(h[1], h[2])) > fileSize)
+            break; // a writer died halfway, append() cuts it off
+        const QByteArray key = f.read(h[1]);
+        if (key.size() != int(h[1]))
+            break;
+        const IndexEntry e = { keyHash(key), offset, recordSize(h[1], h[2]), m_generation, 0 };
+        if (!m_tail.contains(key)) {
+            const quint32 old = findRecord(key, e.keyHash);
+            if (old)
+                m_removed.insert(old);
+        }
+        m_tail.insert(key, e);
+        offset += e.size;
+        m_dirty = true;
+        ++count;
+    }
+    if (count)
+        qCDebug(DBG_SHADER_CACHE, "Picked up %d records appended to %s by other processes", count, qPrintable(m_packFileName));
+    m_packSize = offset;
+    return true;
+}
+
+// Rewrites the pack with the most recently used records that fit in maxSize.
+// The new files replace the old ones on disk while this process keeps using
+// its existing mapping, so the pack is read-only for the rest of the session.
+void QOpenGLProgramBinaryPack::evict(qint64 maxSize)
+{
+    QMutexLocker locker(&m_lock);
+    if (m_frozen)
+        return;
+    SharedLocker sharedLock(m_lockFile.data());
+    if (!sharedLock.locked || !syncShared() || m_packSize <= maxSize)
+        return;
+    if (m_appendFile.isOpen())
+        m_appendFile.flush();
+
+    QVector<IndexEntry> entries = liveEntries();
+    std::sort(entries.begin(), entries.end(), [](const IndexEntry &a, const IndexEntry &b) {
+        return a.lastUse != b.lastUse ? a.lastUse > b.lastUse : a.offset > b.offset;
+    });
+
+    // m_packData may not cover what this process appended, so map it all again
+    QFile src(m_packFileName);
+    const uchar *srcData = src.open(QIODevice::ReadOnly) ? src.map(0, m_packSize) : nullptr;
+    if (!srcData)
+        return;
+
+    QSaveFile dst(m_packFileName);
+    if (!dst.open(QIODevice::WriteOnly))
+        return;
+    const quint32 header[] = { BINPACK_MAGIC, BINPACK_VERSION, BINPACK_QTVERSION };
+    dst.write(reinterpret_cast<const char *>(header), PACK_HEADER_SIZE);
+
+    QVector<IndexEntry> kept;
+    quint32 size = PACK_HEADER_SIZE;
+    for (const IndexEntry &e : qAsConst(entries)) {
+        if (size + qint64(e.size) > maxSize || qint64(e.offset) + e.size > m_packSize)
+            continue;
+        dst.write(reinterpret_cast<const char *>(srcData + e.offset), e.size);
+        IndexEntry n = e;
+        n.offset = size;
+        kept.append(n);
+        size += e.size;
+    }
+    if (!dst.commit()) {
+        qCDebug(DBG_SHADER_CACHE, "Failed to compact %s", qPrintable(m_packFileName));
+        return;
+    }
+    writeIndex(kept, size);
+
+    qCDebug(DBG_SHADER_CACHE, "Compacted pack from %u to %u bytes, %d of %d entries kept",
+            m_packSize, size, kept.count(), entries.count());
+    m_appendFile.close();
+    m_frozen = true;
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,115 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the QtGui module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see https://www.qt.io/terms-conditions. For further
+** information use the contact form at https://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl-3.0.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or (at your option) the GNU General
+** Public license version 3 or any later version approved by the KDE Free
+** Qt Foundation. The licenses are as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL2 and LICENSE.GPL3
+** included in the packaging of this file. Please review the following
+** information to ensure the GNU General Public License requirements will
+** be met: https://www.gnu.org/licenses/gpl-2.0.html and
+** https://www.gnu.org/licenses/gpl-3.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#ifndef QOPENGLPROGRAMBINARYPACK_P_H
+#define QOPENGLPROGRAMBINARYPACK_P_H
+
+#include <QtCore/qglobal.h>
+#include <QtCore/qfile.h>
+#include <QtCore/qhash.h>
+#include <QtCore/qset.h>
+#include <QtCore/qvector.h>
+#include <QtCore/qmutex.h>
+#include <QtCore/qlockfile.h>
+#include <QtCore/qscopedpointer.h>
+
+QT_BEGIN_NAMESPACE
+
+// A single append-only archive holding all cached programs, plus a sorted
+// index of key hashes. Both are mapped once, so a lookup is a binary search
+// and a pointer into the mapping instead of an open/mmap/munmap per program.
+//
+// A shared pack may be appended to by several processes. Appends, index writes
+// and compaction then happen under a lock file, after picking up the records
+// the other processes appended in the meantime.
+class QOpenGLProgramBinaryPack
+{
+public:
+    QOpenGLProgramBinaryPack(const QString &dir, bool shared = false);
+    ~QOpenGLProgramBinaryPack();
+
+    bool find(const QByteArray &cacheKey, const uchar **data, quint32 *size);
+    void willNeed(const QByteArray &cacheKey);
+    static void readAhead(const QString &dir);
+    void remove(const QByteArray &cacheKey);
+    bool append(const QByteArray &cacheKey, const QByteArray &data);
+    void flush();
+    void evict(qint64 maxSize);
+
+private:
+    struct IndexEntry {
+        quint64 keyHash;
+        quint32 offset;
+        quint32 size;
+        quint32 lastUse;
+        quint32 reserved;
+    };
+
+    void open();
+    void scan(quint32 from);
+    bool recordAt(quint32 offset, QByteArray *key, const uchar **data, quint32 *size) const;
+    quint32 findRecord(const QByteArray &cacheKey, quint64 hash) const;
+    QVector<IndexEntry> liveEntries() const;
+    bool writeIndex(QVector<IndexEntry> entries, quint32 packSize);
+    bool replacedOnDisk() const;
+    bool syncShared();
+
+    QString m_packFileName;
+    QString m_indexFileName;
+    QMutex m_lock;
+    QFile m_packFile;
+    const uchar *m_packData;
+    quint32 m_packMapSize;
+    quint32 m_packSize;
+    QFile m_indexFile;
+    const IndexEntry *m_index;
+    int m_indexCount;
+    QHash<QByteArray, IndexEntry> m_tail;
+    QSet<quint32> m_removed;
+    QSet<quint32> m_used;
+    quint32 m_generation;
+    QFile m_appendFile;
+    bool m_dirty;
+    bool m_frozen;
+    QScopedPointer<QLockFile> m_lockFile;
+};
+
+QT_END_NAMESPACE
+
+#endif
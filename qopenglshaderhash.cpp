@@ -0,0 +1,132 @@
+/****************************************************************************
+**
+** Copyright (C) 2016 The Qt Company Ltd.
+** Contact: https://www.qt.io/licensing/
+**
+** This file is part of the QtGui module of the Qt Toolkit.
+**
+** $QT_BEGIN_LICENSE:LGPL$
+** Commercial License Usage
+** Licensees holding valid commercial Qt licenses may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement between you and The Qt Company. For licensing terms
+** and conditions see https://www.qt.io/terms-conditions. For further
+** information use the contact form at https://www.qt.io/contact-us.
+**
+** GNU Lesser General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 3 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL3 included in the
+** packaging of this file. Please review the following information to
+** ensure the GNU Lesser General Public License version 3 requirements
+** will be met: https://www.gnu.org/licenses/lgpl-3.0.html.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 2.0 or (at your option) the GNU General
+** Public license version 3 or any later version approved by the KDE Free
+** Qt Foundation. The licenses are as published by the Free Software
+** Foundation and appearing in the file LICENSE.GPL2 and LICENSE.GPL3
+** included in the packaging of this file. Please review the following
+** information to ensure the GNU General Public License requirements will
+** be met: https://www.gnu.org/licenses/gpl-2.0.html and
+** https://www.gnu.org/licenses/gpl-3.0.html.
+**
+** $QT_END_LICENSE$
+**
+****************************************************************************/
+
+#include "qopenglshaderhash_p.h"
+#include <QtCore/qendian.h>
+#include <string.h>
+
+QT_BEGIN_NAMESPACE
+
+// Public domain reference by Austin Appleby (SMHasher). Blocks are read as
+// little endian so that caches baked on one machine match on another.
+
+static inline quint64 rotl64(quint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline quint64 fmix64(quint64 k)
+{
+    k ^= k >> 33;
+    k *= Q_UINT64_C(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
+static inline quint64 readBlock(const uchar *p)
+{
+    quint64 v;
+    memcpy(&v, p, sizeof(v));
+    return qFromLittleEndian(v);
+}
+
+void QOpenGLShaderHash::hash(const void *data, size_t len, quint32 seed, uchar *result)
+{
+    const uchar *p = static_cast<const uchar *>(data);
+    const size_t nblocks = len / 16;
+    const quint64 c1 = Q_UINT64_C(0x87c37b91114253d5);
+    const quint64 c2 = Q_UINT64_C(0x4cf5ad432745937f);
+    quint64 h1 = seed;
+    quint64 h2 = seed;
+
+    for (size_t i = 0; i < nblocks; ++i, p += 16) {
+        quint64 k1 = readBlock(p);
+        quint64 k2 = readBlock(p + 8);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    quint64 k1 = 0;
+    quint64 k2 = 0;
+    switch (len & 15) {
+    case 15: k2 ^= quint64(p[14]) << 48; Q_FALLTHROUGH();
+    case 14: k2 ^= quint64(p[13]) << 40; Q_FALLTHROUGH();
+    case 13: k2 ^= quint64(p[12]) << 32; Q_FALLTHROUGH();
+    case 12: k2 ^= quint64(p[11]) << 24; Q_FALLTHROUGH();
+    case 11: k2 ^= quint64(p[10]) << 16; Q_FALLTHROUGH();
+    case 10: k2 ^= quint64(p[9]) << 8; Q_FALLTHROUGH();
+    case 9:  k2 ^= quint64(p[8]);
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+             Q_FALLTHROUGH();
+    case 8:  k1 ^= quint64(p[7]) << 56; Q_FALLTHROUGH();
+    case 7:  k1 ^= quint64(p[6]) << 48; Q_FALLTHROUGH();
+    case 6:  k1 ^= quint64(p[5]) << 40; Q_FALLTHROUGH();
+    case 5:  k1 ^= quint64(p[4]) << 32; Q_FALLTHROUGH();
+    case 4:  k1 ^= quint64(p[3]) << 24; Q_FALLTHROUGH();
+    case 3:  k1 ^= quint64(p[2]) << 16; Q_FALLTHROUGH();
+    case 2:  k1 ^= quint64(p[1]) << 8; Q_FALLTHROUGH();
+    case 1:  k1 ^= quint64(p[0]);
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+             break;
+    default:
+        break;
+    }
+
+    h1 ^= quint64(len);
+    h2 ^= quint64(len);
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    h1 = qToLittleEndian(h1);
+    h2 = qToLittleEndian(h2);
+    memcpy(result, &h1, sizeof(h1));
+    memcpy(result + 8, &h2, sizeof(h2));
+}
+
+QT_END_NAMESPACE
@@ -0,0 +1,287 @@
+// Headless link benchmark, the offscreen counterpart of the demo in main.cpp.
+//
+//   shaderbench [--programs 100] [--size 2048] [--repeat 10] [--batch]
+//               [--gles] [--version 3.0] [--json] [--dir cachedir]
+//
+// Each repetition times linking --programs distinct programs in four ways:
+//
+//   plain   QOpenGLShaderProgram, always compiled
+//   cold    QOpenGLCacheableShaderProgram, nothing cached yet
+//   warm    the same programs again, loaded from disk (memory cache disabled)
+//   memory  the same programs again, served from the in-process memory cache
+//
+// Every repetition uses fresh sources, so cold stays cold without clearing the
+// cache directory, which defaults to a temporary one. The same goes for Mesa's
+// own shader cache, which is kept in that directory unless configured
+// otherwise; it must stay enabled, since without it Gallium drivers offer no
+// program binary formats. Exits with an error when there are none.
+// Prints the median and 95th percentile in ms as CSV, or as JSON together with
+// the cache statistics. Runs on llvmpipe with QT_QPA_PLATFORM=offscreen under
+// Xvfb, or with eglfs on Mesa's surfaceless EGL platform.
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QSurfaceFormat>
+#include <QTemporaryDir>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QFile>
+#include <algorithm>
+#include <cstdio>
+#include "qopenglcacheableshaderprogram.h"
+
+enum Scenario { Plain, Cold, Warm, Memory, ScenarioCount };
+
+static const char *scenarioNames[ScenarioCount] = { "plain", "cold", "warm", "memory" };
+
+static const char *fsrc =
+    "varying lowp vec4 col;\n"
+    "void main() {\n"
+    "   gl_FragColor = col;\n"
+    "}\n";
+
+// A vertex shader of roughly the given size, with real work for the compiler
+// and a tag that makes it unique to one program of one repetition.
+static QByteArray makeVertexShader(const QByteArray &tag, int size)
+{
+    QByteArray src("attribute highp vec4 posAttr;\n"
+                   "attribute lowp vec4 colAttr;\n"
+                   "varying lowp vec4 col;\n"
+                   "uniform highp mat4 matrix;\n"
+                   "uniform highp float tag_" + tag + ";\n"
+                   "void main() {\n"
+                   "   highp vec4 v = colAttr;\n");
+    for (int i = 0; src.size() < size - 64; ++i)
+        src += "   v = fract(v * " + QByteArray::number(1.0 + i * 0.001, 'f', 3) + " + posAttr.yzwx);\n";
+    src += "   col = v;\n"
+           "   gl_Position = matrix * posAttr;\n"
+           "}\n";
+    return src;
+}
+
+struct Options
+{
+    int programs = 100;
+    int size = 2048;
+    bool batch = false;
+};
+
+static void addShaders(QOpenGLShaderProgram *prog, const QByteArray &vs)
+{
+    prog->addShaderFromSourceCode(QOpenGLShader::Vertex, vs);
+    prog->addShaderFromSourceCode(QOpenGLShader::Fragment, fsrc);
+}
+
+static void addShaders(QOpenGLCacheableShaderProgram *prog, const QByteArray &vs)
+{
+    prog->addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vs);
+    prog->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fsrc);
+}
+
+static bool linkPrograms(QVector<QOpenGLShaderProgram *> &programs, bool)
+{
+    bool ok = true;
+    for (QOpenGLShaderProgram *prog : qAsConst(programs))
+        ok &= prog->link();
+    return ok;
+}
+
+static bool linkPrograms(QVector<QOpenGLCacheableShaderProgram *> &programs, bool batch)
+{
+    if (batch)
+        return QOpenGLCacheableShaderProgram::linkAll(programs);
+    bool ok = true;
+    for (QOpenGLCacheableShaderProgram *prog : qAsConst(programs))
+        ok &= prog->link();
+    return ok;
+}
+
+// Returns the time in ms from adding the sources until all programs are
+// linked and the driver is idle.
+template <typename Program>
+static double timeLink(const Options &opt, const QVector<QByteArray> &sources)
+{
+    QOpenGLFunctions *f = QOpenGLContext::currentContext()->functions();
+    QVector<Program *> programs;
+    programs.reserve(sources.count());
+    f->glFinish();
+    QElapsedTimer timer;
+    timer.start();
+    for (const QByteArray &vs : sources) {
+        Program *prog = new Program;
+        addShaders(prog, vs);
+        programs.append(prog);
+    }
+    if (!linkPrograms(programs, opt.batch))
+        qFatal("Link failed: %s", qPrintable(programs.first()->log()));
+    f->glFinish();
+    const double ms = timer.nsecsElapsed() / 1000000.0;
+    qDeleteAll(programs);
+    return ms;
+}
+
+static QVector<QByteArray> makeSources(const Options &opt, const QByteArray &run)
+{
+    QVector<QByteArray> sources;
+    sources.reserve(opt.programs);
+    for (int i = 0; i < opt.programs; ++i)
+        sources.append(makeVertexShader(run + '_' + QByteArray::number(i), opt.size));
+    return sources;
+}
+
+// The same checks as the cache's own, which would otherwise silently compile
+// in all four scenarios.
+static bool programBinarySupported(QOpenGLContext *ctx)
+{
+    if (ctx->isOpenGLES()) {
+        if (ctx->format().majorVersion() < 3 && !ctx->hasExtension("GL_OES_get_program_binary"))
+            return false;
+    } else if (!ctx->hasExtension("GL_ARB_get_program_binary")) {
+        return false;
+    }
+    GLint formats = 0;
+    ctx->functions()->glGetIntegerv(0x87FE /* GL_NUM_PROGRAM_BINARY_FORMATS */, &formats);
+    return formats > 0;
+}
+
+// Nearest rank, on a sorted list.
+static double percentile(const QVector<double> &sorted, int p)
+{
+    const int rank = (p * sorted.count() + 99) / 100;
+    return sorted.at(qBound(0, rank - 1, sorted.count() - 1));
+}
+
+int main(int argc, char **argv)
+{
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption programsOption(QStringLiteral("programs"), QStringLiteral("Programs per run"), QStringLiteral("count"), QStringLiteral("100"));
+    QCommandLineOption sizeOption(QStringLiteral("size"), QStringLiteral("Vertex shader size"), QStringLiteral("bytes"), QStringLiteral("2048"));
+    QCommandLineOption repeatOption(QStringLiteral("repeat"), QStringLiteral("Runs per scenario"), QStringLiteral("count"), QStringLiteral("10"));
+    QCommandLineOption batchOption(QStringLiteral("batch"), QStringLiteral("Link the cacheable programs with linkAll()"));
+    QCommandLineOption glesOption(QStringLiteral("gles"), QStringLiteral("Use an OpenGL ES context"));
+    QCommandLineOption versionOption(QStringLiteral("version"), QStringLiteral("Context version"), QStringLiteral("major.minor"));
+    QCommandLineOption jsonOption(QStringLiteral("json"), QStringLiteral("Print JSON instead of CSV"));
+    QCommandLineOption dirOption(QStringLiteral("dir"), QStringLiteral("Cache directory instead of a temporary one"), QStringLiteral("dir"));
+    parser.addOption(programsOption);
+    parser.addOption(sizeOption);
+    parser.addOption(repeatOption);
+    parser.addOption(batchOption);
+    parser.addOption(glesOption);
+    parser.addOption(versionOption);
+    parser.addOption(jsonOption);
+    parser.addOption(dirOption);
+
+    // The cache reads its configuration on first use, which is after this.
+    QStringList args;
+    for (int i = 0; i < argc; ++i)
+        args.append(QString::fromLocal8Bit(argv[i]));
+    parser.parse(args);
+    QTemporaryDir tempDir;
+    const QString cacheDir = parser.isSet(dirOption) ? parser.value(dirOption) : tempDir.path();
+    qputenv("QT_SHADER_CACHE_DIR", QFile::encodeName(cacheDir));
+    qunsetenv("QT_DISABLE_SHADER_CACHE");
+    qunsetenv("QT_SHADER_CACHE_WARMUP");
+    // measures the cache as such, not whether it pays off
+    qputenv("QT_SHADER_CACHE_ADAPTIVE", "0");
+    if (!qEnvironmentVariableIsSet("MESA_SHADER_CACHE_DIR"))
+        qputenv("MESA_SHADER_CACHE_DIR", QFile::encodeName(cacheDir + QLatin1String("/mesa")));
+    if (!qEnvironmentVariableIsSet("MESA_GLSL_CACHE_DIR"))
+        qputenv("MESA_GLSL_CACHE_DIR", QFile::encodeName(cacheDir + QLatin1String("/mesa")));
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication app(argc, argv);
+    parser.process(app);
+
+    Options opt;
+    opt.programs = qMax(1, parser.value(programsOption).toInt());
+    opt.size = parser.value(sizeOption).toInt();
+    opt.batch = parser.isSet(batchOption);
+    const int repeat = qMax(1, parser.value(repeatOption).toInt());
+
+    QSurfaceFormat fmt = QSurfaceFormat::defaultFormat();
+    if (parser.isSet(glesOption))
+        fmt.setRenderableType(QSurfaceFormat::OpenGLES);
+    if (parser.isSet(versionOption)) {
+        const QStringList v = parser.value(versionOption).split(QLatin1Char('.'));
+        fmt.setVersion(v.value(0).toInt(), v.value(1).toInt());
+    }
+    QOpenGLContext context;
+    context.setFormat(fmt);
+    if (!context.create())
+        qFatal("Failed to create context");
+    QOffscreenSurface surface;
+    surface.setFormat(context.format());
+    surface.create();
+    if (!context.makeCurrent(&surface))
+        qFatal("Failed to make context current");
+
+    const QByteArray renderer(reinterpret_cast<const char *>(context.functions()->glGetString(GL_RENDERER)));
+    if (!programBinarySupported(&context)) {
+        fprintf(stderr, "shaderbench: %s offers no program binary formats, nothing to measure "
+                        "(on Mesa, check that MESA_SHADER_CACHE_DISABLE is not set)\n", renderer.constData());
+        return 1;
+    }
+    const qint64 memoryLimit = QOpenGLCacheableShaderProgram::memoryCacheSizeLimit();
+    const QByteArray runId = QByteArray::number(QCoreApplication::applicationPid());
+
+    // Untimed, so that the first run does not pay for driver initialization.
+    timeLink<QOpenGLShaderProgram>(opt, makeSources(opt, "init" + runId));
+    QOpenGLCacheableShaderProgram::resetCacheStatistics();
+
+    QVector<double> times[ScenarioCount];
+    for (int r = 0; r < repeat; ++r) {
+        const QByteArray run = runId + '_' + QByteArray::number(r);
+        times[Plain].append(timeLink<QOpenGLShaderProgram>(opt, makeSources(opt, "plain" + run)));
+
+        const QVector<QByteArray> sources = makeSources(opt, "cached" + run);
+        times[Cold].append(timeLink<QOpenGLCacheableShaderProgram>(opt, sources));
+        QOpenGLCacheableShaderProgram::flushCache();
+
+        QOpenGLCacheableShaderProgram::setMemoryCacheSizeLimit(0);
+        times[Warm].append(timeLink<QOpenGLCacheableShaderProgram>(opt, sources));
+
+        QOpenGLCacheableShaderProgram::setMemoryCacheSizeLimit(memoryLimit);
+        timeLink<QOpenGLCacheableShaderProgram>(opt, sources);
+        times[Memory].append(timeLink<QOpenGLCacheableShaderProgram>(opt, sources));
+    }
+    context.doneCurrent();
+
+    if (parser.isSet(jsonOption)) {
+        QJsonObject results;
+        for (int s = 0; s < ScenarioCount; ++s) {
+            std::sort(times[s].begin(), times[s].end());
+            QJsonArray runs;
+            for (double ms : qAsConst(times[s]))
+                runs.append(ms);
+            QJsonObject scenario;
+            scenario.insert(QStringLiteral("medianMs"), percentile(times[s], 50));
+            scenario.insert(QStringLiteral("p95Ms"), percentile(times[s], 95));
+            scenario.insert(QStringLiteral("runsMs"), runs);
+            results.insert(QLatin1String(scenarioNames[s]), scenario);
+        }
+        QJsonObject doc;
+        doc.insert(QStringLiteral("renderer"), QString::fromLatin1(renderer));
+        doc.insert(QStringLiteral("programs"), opt.programs);
+        doc.insert(QStringLiteral("shaderSize"), opt.size);
+        doc.insert(QStringLiteral("repeat"), repeat);
+        doc.insert(QStringLiteral("batch"), opt.batch);
+        doc.insert(QStringLiteral("results"), results);
+        doc.insert(QStringLiteral("cacheStatistics"), QOpenGLCacheableShaderProgram::cacheStatistics());
+        printf("%s", QJsonDocument(doc).toJson().constData());
+    } else {
+        printf("scenario,programs,shader_size,runs,median_ms,p95_ms\n");
+        for (int s = 0; s < ScenarioCount; ++s) {
+            std::sort(times[s].begin(), times[s].end());
+            printf("%s,%d,%d,%d,%.3f,%.3f\n", scenarioNames[s], opt.programs, opt.size, repeat,
+                   percentile(times[s], 50), percentile(times[s], 95));
+        }
+    }
+    return 0;
+}